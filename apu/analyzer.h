@@ -0,0 +1,107 @@
+
+// Song Analyzer
+//
+
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <stdint.h>
+#include "apu/format.h"
+
+namespace apu {
+
+
+// Analyzer cost model in MCU cycles, these are rough
+// figures for a Cortex-M4 and can be tuned per target
+#ifndef ANALYZER_TICK_CYCLES
+#define ANALYZER_TICK_CYCLES 400
+#endif
+
+// Sequences and modulation of one channel each tick
+#ifndef ANALYZER_CHANNEL_CYCLES
+#define ANALYZER_CHANNEL_CYCLES 250
+#endif
+
+// Each command byte run in a row
+#ifndef ANALYZER_COMMAND_CYCLES
+#define ANALYZER_COMMAND_CYCLES 60
+#endif
+
+// Each instrument change, which reloads the sequences
+#ifndef ANALYZER_INSTRUMENT_CYCLES
+#define ANALYZER_INSTRUMENT_CYCLES 200
+#endif
+
+// Each channel timer edge, either a ticker interrupt
+// or an iteration of the bus clock loop
+#ifndef ANALYZER_EDGE_CYCLES
+#define ANALYZER_EDGE_CYCLES 120
+#endif
+
+// Fixed cost of mixing a bus sample
+#ifndef ANALYZER_SAMPLE_CYCLES
+#define ANALYZER_SAMPLE_CYCLES 150
+#endif
+
+
+// Finds the worst-case cost of songs from their compiled data
+//
+// Every row of every frame is walked once without playing the
+// song. Effects that change the period over time, such as slides
+// and vibrato, are not followed, so periods are found from the
+// notes and their arpeggios.
+class Analyzer {
+public:
+    // Worst-case figures of a song
+    struct Report {
+        // Most commands run in a single row across all channels
+        unsigned row_commands;
+
+        // Most instrument changes in a single row and a single frame
+        unsigned row_instruments;
+        unsigned frame_instruments;
+
+        // Shortest period of any channel in NES clock cycles,
+        // 0 if no notes are played
+        uint16_t min_period;
+
+        // Channel timer edges per tick with every channel
+        // playing its shortest period
+        unsigned edges;
+
+        // MCU cycles of the costliest tick, and of a whole tick
+        // period including the channel timer edges
+        unsigned tick_cycles;
+        unsigned frame_cycles;
+    };
+
+private:
+    const uint8_t *_data;
+    uint8_t _expansion;
+    uint8_t _voices;
+
+    inline uint8_t read(uint16_t addr);
+    inline uint16_t lookup(uint16_t addr, unsigned off);
+
+    uint16_t extra(uint16_t inst);
+    int8_t arpeggio(uint16_t inst);
+
+public:
+    // Analyzer lifetime, songs using expansion chips pass the same
+    // flags and N163 voices as when loading them
+    Analyzer(const uint8_t *data, uint8_t expansion=0, uint8_t voices=0);
+
+    // Analyze a song
+    Report analyze(int song);
+
+    // Recommended size in samples of the buffer a Bus renders ahead
+    // into for an MCU running at a clock in Hz, 0 if the song can
+    // not keep up
+    static unsigned depth(const Report &report, uint32_t clock);
+};
+
+
+}
+
+#endif
+
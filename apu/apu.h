@@ -6,39 +6,88 @@
 #define APU_H
 
 #include <stdint.h>
+#include "apu/clock.h"
 #include "mbed-drivers/Ticker.h"
 #include "mbed-drivers/AnalogOut.h"
 
 namespace apu {
 
 
-// APU Settings
-#define APU_FREQ 1789772
-
 class APU; // predeclared
-
-
-// Base channel representation
+class TickerChannel; // predeclared
+class Bus; // predeclared
+class NSF; // predeclared
+class Log; // predeclared
+class Replay; // predeclared
+class Scope; // predeclared
+class Memo; // predeclared
+class Expansion; // predeclared
+
+
+// Base channel representation, channels are clocked with clock
+// and only run off their own timer when derived from TickerChannel
 class Channel {
 protected:
     friend APU;
+    friend Bus;
 
-    unsigned _tick;
-    uint16_t _output;
+    APU *_apu;
+    int32_t _timer;
 
     uint16_t _period;
-    bool _update;
-
-    uint8_t _duty;
-    uint8_t _volume;
     int16_t _pitch;
 
-    mbed::Ticker _ticker;
-    APU *_apu;
+    uint8_t _tick;
+    uint8_t _output;
 
-    void retick(unsigned);
+    uint8_t _duty;
+    uint8_t _volume;
+    bool _update;
+    uint8_t _index;
+
+    // Envelope, length counter and sweep units
+    uint8_t _envelope;
+    uint8_t _divider;
+    uint8_t _decay;
+    uint8_t _length;
+    uint8_t _length_load;
+    uint8_t _sweep;
+    uint8_t _sweep_divider;
+    bool _sweep_reload;
+
+    virtual void retick(unsigned);
+    virtual void detach();
+    void reperiod(uint16_t);
+    void reload();
+    void stop();
+    void record(uint8_t cmd, uint16_t arg=0, const uint8_t *data=0);
+
+    // Frame sequencer clocks
+    void quarter_frame();
+    void half_frame();
 
 public:
+    // Synthesis state, saved and restored by the render cache
+    struct Snapshot {
+        int32_t timer;
+        uint16_t period;
+        int16_t pitch;
+        uint8_t tick;
+        uint8_t output;
+        uint8_t duty;
+        uint8_t volume;
+        uint16_t shift;
+
+        uint8_t envelope;
+        uint8_t divider;
+        uint8_t decay;
+        uint8_t length;
+        uint8_t length_load;
+        uint8_t sweep;
+        uint8_t sweep_divider;
+        bool sweep_reload;
+    };
+
     // Channel lifetime
     Channel();
     virtual ~Channel() = default;
@@ -47,6 +96,10 @@ public:
     virtual void tick();
     virtual void update() = 0;
 
+    // Advance the channel by a number of NES clock cycles,
+    // used instead of the ticker when driven by a bus
+    void clock(unsigned cycles);
+
     // Enable/disable specified channel
     virtual void enable();
     virtual void disable();
@@ -77,41 +130,92 @@ public:
     // Set the duty cycle of a channel
     virtual void duty(uint8_t duty);
 
+    // Decay the volume from 15 over 16 steps of period+1 quarter
+    // frames, restarting on each note, setting the volume stops it
+    virtual void envelope(uint8_t period, bool loop=false);
+
+    // Silence the channel after a number of half frames, loaded on
+    // each note from the hardware length table, indices past the
+    // end of the table disable the counter
+    virtual void length(uint8_t index);
+
+    // Sweep the period every half frame, the format matches the
+    // hardware register: enable, 3-bit period, negate, 3-bit shift
+    virtual void sweep(uint8_t sweep);
+
+    // Load a wave of 4-bit samples packed two to a byte, ignored
+    // by channels without a wavetable
+    virtual void wave(const uint8_t *packed, uint8_t size);
+
     // Get the current amplitude of the channel
     virtual uint8_t output();
+
+    // Save/restore the synthesis state
+    virtual void save(Snapshot &snapshot);
+    virtual void restore(const Snapshot &snapshot);
+};
+
+// Channel updated from its own ticker unless driven by a bus
+class TickerChannel : public Channel {
+protected:
+    mbed::Ticker _ticker;
+
+    virtual void retick(unsigned);
+    virtual void detach();
 };
 
 // NES Channels
-class Square : public Channel {
+class Square : public TickerChannel {
 public:
     virtual uint16_t to_period(uint8_t);
     virtual void update();
 };
 
-class Triangle : public Channel {
+class Triangle : public TickerChannel {
 public:
     virtual uint16_t to_period(uint8_t);
     virtual void update();
 };
 
-class Noise : public Channel {
+class Noise : public TickerChannel {
 private:
     uint16_t _shift = 0x0001;
 
 public:
     virtual uint16_t to_period(uint8_t);
     virtual void update();
+
+    virtual void save(Snapshot &snapshot);
+    virtual void restore(const Snapshot &snapshot);
 };
 
 
 // Audio processing unit
 class APU {
 private:
+    friend Channel;
+    friend TickerChannel;
+    friend Bus;
+    friend NSF;
+    friend Replay;
+    friend Scope;
+
     Channel **_channels;
     unsigned _count;
     uint8_t _output;
+    uint16_t _gain;
 
     mbed::AnalogOut _dac;
+    Bus *_bus;
+    Log *_log;
+    Scope *_scope;
+    Expansion *_expansion;
+
+    uint32_t _phase;
+    uint8_t _step;
+
+    unsigned sequence(unsigned cycles);
+    Channel *find(unsigned channel);
 
 public:
     // APU lifetime
@@ -129,6 +233,9 @@ public:
     // Period is based on NES clock cycles
     void period(unsigned channel, uint16_t period);
 
+    // Adjust period without timer reset
+    void adjust(unsigned channel, uint16_t period);
+
     // Set the volume of a channel
     void volume(unsigned channel, uint8_t volume);
 
@@ -138,6 +245,39 @@ public:
     // Set the duty cycle of a channel
     void duty(unsigned channel, uint8_t duty);
 
+    // Start a volume envelope on a channel
+    void envelope(unsigned channel, uint8_t period, bool loop=false);
+
+    // Set the length counter of a channel
+    void length(unsigned channel, uint8_t index);
+
+    // Set the sweep unit of a channel
+    void sweep(unsigned channel, uint8_t sweep);
+
+    // Load a wave into a channel, such as an N163 voice
+    void wave(unsigned channel, const uint8_t *packed, uint8_t size);
+
+    // Set the master gain, 0x100 is unity
+    void gain(uint16_t gain);
+
+    // Record channel control calls into a log, 0 stops recording
+    void record(Log *log);
+
+    // Tap the channel outputs into a scope, 0 removes the tap
+    void scope(Scope *scope);
+
+    // Add an expansion chip, 0 removes all expansions, expansions
+    // are rendered in blocks and only heard through a bus, their
+    // channels follow the APU's own channels in the order added
+    void expand(Expansion *expansion);
+
+    // Clock the frame sequencer by a quarter frame, returns true at the
+    // end of a frame. A standalone APU must have this called from a timer
+    // at APU_SEQUENCER_FREQ for envelopes, length counters and sweeps to
+    // run, NSF players and replays do this themselves and a bus clocks
+    // the sequencer of its sources
+    bool step();
+
     // Updates the output
     void update();
 
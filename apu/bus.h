@@ -0,0 +1,113 @@
+
+// Mixing Bus
+//
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+#include "apu/apu.h"
+#include "apu/nsf.h"
+#include "apu/memo.h"
+#include "mbed-drivers/Ticker.h"
+#include "mbed-drivers/AnalogOut.h"
+#include <atomic>
+
+namespace apu {
+
+
+// Bus settings, the output rate and block size are
+// in apu/clock.h
+#define BUS_SOURCES 4
+
+
+// Mixes several APUs onto a single output
+//
+// All sources are clocked from one sample timer. Sources with a
+// higher priority take over channels from lower priority sources
+// while they are playing, the lower priority channels keep running
+// but are not heard.
+//
+// By default the output timer renders a block of BUS_BLOCK samples
+// whenever it runs out. Given a deeper buffer, samples are rendered
+// ahead by calling fill from a thread or event loop instead, and the
+// output timer only plays them out.
+class Bus {
+private:
+    struct Source {
+        APU *apu;
+        NSF *nsf;
+        Replay *replay;
+        Memo *memo;
+        uint16_t gain;
+        uint8_t priority;
+
+        // Block of expansion output, mixed in sample by sample
+        uint16_t expansion[BUS_BLOCK];
+    };
+
+    Source _sources[BUS_SOURCES];
+    unsigned _count;
+
+    unsigned _cycles;
+
+    // Output ring, written at the head and played from the tail
+    uint8_t _block[BUS_BLOCK];
+    uint8_t *_buffer;
+    unsigned _size;
+    bool _ahead;
+    uint8_t _last;
+    std::atomic<unsigned> _head;
+    std::atomic<unsigned> _tail;
+
+    mbed::AnalogOut _dac;
+    mbed::Ticker _ticker;
+
+    bool attach(APU *apu, NSF *nsf, Replay *replay,
+            uint16_t gain, uint8_t priority);
+    Source *find(APU *apu);
+    unsigned mix(unsigned cycles, unsigned n);
+    void sample();
+
+public:
+    // Bus lifetime, a buffer of a power of two samples, at least
+    // BUS_BLOCK, turns on rendering ahead with fill
+    Bus(PinName pin=DAC0_OUT, uint8_t *buffer=0, unsigned size=0);
+
+    // Attach a source, returns false if the bus is full
+    // Gain of 0x100 is unity, higher priorities take over channels
+    bool attach(APU *apu, uint16_t gain=0x100, uint8_t priority=0);
+    bool attach(NSF *nsf, uint16_t gain=0x100, uint8_t priority=0);
+    bool attach(Replay *replay, uint16_t gain=0x100, uint8_t priority=0);
+
+    // Detach a source, returning it to its own timers
+    void detach(APU *apu);
+    void detach(NSF *nsf);
+    void detach(Replay *replay);
+
+    // Set the gain of a source
+    void gain(APU *apu, uint16_t gain);
+    void gain(NSF *nsf, uint16_t gain);
+
+    // Cache the rendered frames of a song, 0 stops caching
+    void memoize(NSF *nsf, Memo *memo);
+
+    // Starting/stopping the output timer
+    void start();
+    void stop();
+
+    // Render ahead into the buffer until it is full, returns the
+    // number of samples rendered, the sources are then run from the
+    // caller instead of the output timer, which repeats the last
+    // sample if the buffer runs dry
+    unsigned fill();
+
+    // Render 6-bit samples at BUS_FREQ without the output timer
+    void render(uint8_t *buffer, unsigned count);
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,49 @@
+
+// Clock Settings
+//
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+namespace apu {
+
+
+// APU Settings
+#define APU_NTSC  0
+#define APU_PAL   1
+#define APU_DENDY 2
+
+// Console region, sets the clock and frame rate
+#ifndef APU_REGION
+#define APU_REGION APU_NTSC
+#endif
+
+// Frequency of A4 in Hz
+#ifndef APU_TUNING
+#define APU_TUNING 440
+#endif
+
+#if APU_REGION == APU_PAL
+#define APU_FREQ 1662607
+#define APU_FRAME_FREQ 50
+#elif APU_REGION == APU_DENDY
+#define APU_FREQ 1773448
+#define APU_FRAME_FREQ 50
+#else
+#define APU_FREQ 1789772
+#define APU_FRAME_FREQ 60
+#endif
+
+// Frame sequencer rate, envelopes are clocked every quarter
+// frame, length counters and sweeps every half frame
+#define APU_SEQUENCER_FREQ (4*APU_FRAME_FREQ)
+
+// Bus settings
+#define BUS_FREQ 25000
+#define BUS_BLOCK 32
+
+
+}
+
+#endif
+
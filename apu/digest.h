@@ -0,0 +1,49 @@
+
+// Output Digest
+//
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+
+namespace apu {
+
+
+// Digest settings, 32-bit FNV-1a
+#define DIGEST_BASIS 0x811c9dc5
+#define DIGEST_PRIME 0x01000193
+
+
+// Running hash over rendered samples or a recorded log
+//
+// Two renders of the same song hash equal only if they are
+// bit-exact, which makes it easy to check that a change to
+// the synthesis or decoding paths did not change the output
+class Digest {
+private:
+    uint32_t _hash;
+    uint32_t _size;
+
+public:
+    // Digest lifetime
+    Digest();
+
+    // Start a new digest
+    void reset();
+
+    // Add data to the digest
+    void update(const uint8_t *data, unsigned size);
+
+    // Get the current hash
+    uint32_t value();
+
+    // Number of bytes hashed
+    uint32_t size();
+};
+
+
+}
+
+#endif
+
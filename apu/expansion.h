@@ -0,0 +1,143 @@
+
+// Expansion Audio
+//
+
+#ifndef EXPANSION_H
+#define EXPANSION_H
+
+#include <stdint.h>
+#include "apu/apu.h"
+#include "apu/format.h"
+
+namespace apu {
+
+
+// Expansion settings
+#ifndef N163_VOICES
+#define N163_VOICES 8
+#endif
+
+
+// Expansion chip rendered a block of samples at a time
+//
+// Chips are attached to an APU and only heard when the APU is
+// driven by a bus. The bus renders each block of output before
+// the APU's own channels, so parameter changes made during a
+// block take effect at the start of the next one. The channels
+// of a chip have no ticker and are clocked by its renderer.
+class Expansion {
+private:
+    friend APU;
+    friend Bus;
+
+    Expansion *_next;
+
+public:
+    // Expansion lifetime
+    Expansion();
+    virtual ~Expansion() = default;
+
+    // Number of channels and the channel at an index
+    virtual unsigned count() = 0;
+    virtual Channel *channel(unsigned index) = 0;
+
+    // Add a block of samples to the mix, cycles holds the
+    // number of NES clock cycles in each sample
+    virtual void render(uint16_t *mix, const uint8_t *cycles,
+            unsigned count) = 0;
+};
+
+
+// Konami VRC6, two pulse channels and a saw channel
+class VRC6 : public Expansion {
+public:
+    // Pulse with 8 duty cycles in sixteenths
+    class Pulse : public Channel {
+    public:
+        virtual uint16_t to_period(uint8_t);
+        virtual void update();
+    };
+
+    // Saw built from an accumulator, the volume
+    // sets the 6-bit accumulator rate
+    class Saw : public Channel {
+    private:
+        uint8_t _accumulator = 0;
+
+    public:
+        virtual uint16_t to_period(uint8_t);
+        virtual void update();
+    };
+
+    Pulse pulse1;
+    Pulse pulse2;
+    Saw saw;
+
+    virtual unsigned count();
+    virtual Channel *channel(unsigned index);
+    virtual void render(uint16_t *mix, const uint8_t *cycles,
+            unsigned count);
+};
+
+
+// Namco 163, up to 8 wavetable voices
+//
+// The hardware updates one voice at a time and switches between
+// them on the output, so more voices play quieter. The renderer
+// also services a single voice per sample, which catches up on the
+// cycles since its last turn in one step instead of an update per
+// timer edge, keeping the cost flat in the number of voices. The
+// output is the average of the latest output of every voice, which
+// is what the switching filters to.
+class N163 : public Expansion {
+public:
+    class Voice : public Channel {
+    private:
+        friend N163;
+
+        uint8_t _wave[N163_WAVE_SIZE];
+        uint8_t _size = 0;
+        uint16_t _level = 0x100;
+        uint32_t _mark = 0;
+
+        void advance(unsigned cycles);
+
+    public:
+        // Load a wave of 4-bit samples packed two to a byte low nibble
+        // first, periods depend on the wave size so the note should
+        // be set after
+        virtual void wave(const uint8_t *packed, uint8_t size);
+
+        virtual uint16_t to_period(uint8_t);
+        virtual void volume(uint8_t volume);
+        virtual void update();
+    };
+
+private:
+    uint8_t _count;
+    uint8_t _turn;
+    uint16_t _scale;
+    uint16_t _sum;
+    uint32_t _cycles;
+
+public:
+    Voice voices[N163_VOICES];
+
+    // N163 lifetime
+    N163();
+
+    // Set the number of voices in use, the first voices are used,
+    // all voices keep their channel index whether in use or not
+    void enable(unsigned count);
+
+    virtual unsigned count();
+    virtual Channel *channel(unsigned index);
+    virtual void render(uint16_t *mix, const uint8_t *cycles,
+            unsigned count);
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,41 @@
+
+// Song Data Format
+//
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+namespace apu {
+
+
+// Sequences of an instrument in the order of its mask bits
+#define NSF_SEQUENCES 5
+
+#define NSF_SEQ_VOLUME   0
+#define NSF_SEQ_ARPEGGIO 1
+#define NSF_SEQ_PITCH    2
+#define NSF_SEQ_HIPITCH  3
+#define NSF_SEQ_DUTY     4
+
+// Channels of a frame in the order of its pattern slots,
+// expansion channels follow the DPCM slot in chip order
+#define NSF_APU_CHANNELS 4
+
+#define NSF_SLOT_SQUARE1  0
+#define NSF_SLOT_SQUARE2  1
+#define NSF_SLOT_TRIANGLE 2
+#define NSF_SLOT_NOISE    3
+#define NSF_SLOT_DPCM     4
+
+// Expansion flags, these match the expansion byte of the NSF header
+#define NSF_EXPANSION_VRC6 0x01
+#define NSF_EXPANSION_N163 0x10
+
+// Largest N163 wave in 4-bit samples
+#define N163_WAVE_SIZE 32
+
+
+}
+
+#endif
+
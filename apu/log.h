@@ -0,0 +1,120 @@
+
+// Channel Control Log
+//
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include "apu/apu.h"
+#include "mbed-drivers/Ticker.h"
+
+namespace apu {
+
+
+// Log settings
+#define LOG_CHANNELS 16
+
+// Log commands, the low nibble holds the channel
+#define LOG_WAIT    0x00
+#define LOG_ENABLE  0x10
+#define LOG_DISABLE 0x20
+#define LOG_NOTE    0x30
+#define LOG_PERIOD  0x40
+#define LOG_ADJUST  0x50
+#define LOG_NUDGE   0x60
+#define LOG_VOLUME  0x70
+#define LOG_PITCH   0x80
+#define LOG_FINE    0x90
+#define LOG_DUTY    0xa0
+#define LOG_ENVELOPE 0xb0
+#define LOG_LENGTH  0xc0
+#define LOG_SWEEP   0xd0
+#define LOG_WAVE    0xe0
+
+
+// Records channel control calls as a compact log
+//
+// Ticks between calls are stored as wait commands, and
+// period adjustments are stored as deltas when they fit.
+// Waves are stored as the size in samples followed by the
+// packed samples.
+class Log {
+private:
+    uint8_t *_buffer;
+    unsigned _size;
+    unsigned _off;
+    unsigned _wait;
+    bool _overflow;
+
+    uint16_t _periods[LOG_CHANNELS];
+
+    void emit(uint8_t byte);
+    void flush();
+
+public:
+    // Log lifetime
+    Log(uint8_t *buffer, unsigned size);
+
+    // Clear any recorded commands
+    void reset();
+
+    // Record a channel control call, data holds the packed
+    // samples of a wave
+    void write(uint8_t cmd, uint8_t channel, uint16_t arg=0,
+            const uint8_t *data=0);
+
+    // Advance the log by one tick
+    void tick();
+
+    // Terminate the log, returns the recorded size
+    unsigned end();
+
+    // Size of the recorded log
+    unsigned size();
+
+    // Check if the log ran out of space
+    bool overflow();
+};
+
+
+// Replays a recorded log on an APU
+//
+// The log advances at the end of each sequencer frame. Attached to a
+// bus, the replay is driven by the bus like an NSF player, otherwise
+// it clocks the APU's sequencer from its own ticker. A log recorded
+// with expansion chips replays on an APU with the same chips added
+// in the same order, and the same number of N163 voices enabled.
+class Replay {
+private:
+    friend Bus;
+
+    const uint8_t *_cmds;
+    unsigned _wait;
+    bool _running;
+
+    uint16_t _periods[LOG_CHANNELS];
+
+    APU *_apu;
+    mbed::Ticker _ticker;
+
+    void step();
+    void advance();
+
+public:
+    // Replay lifetime
+    Replay(APU *apu);
+
+    // Loads a recorded log
+    void load(const uint8_t *log);
+
+    // Starting/stopping the replay
+    void start();
+    void stop();
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,105 @@
+
+// Render Cache
+//
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdint.h>
+#include "apu/nsf.h"
+
+namespace apu {
+
+
+// Render cache settings
+#define MEMO_ENTRIES 16
+#define MEMO_PAGES 256
+#define MEMO_PAGE_SIZE 512
+
+// Cached channel outputs are marked while the channel plays
+#define MEMO_PLAYING 0x80
+
+// Nibbles stored for each sample, the 4-bit output of each
+// channel followed by a mask of the channels playing
+#define MEMO_NIBBLES (NSF_APU_CHANNELS + 1)
+
+
+// Caches the rendered output of song frames
+//
+// Entries are keyed by the frame and a hash of the sequencer and
+// channel state on frame entry. When a frame repeats with the same
+// state its samples are copied out of the cache, and the state at the
+// end of the frame is restored instead of running the sequencer and
+// synthesizer. Samples hold the output of each channel, so playback
+// still leaves channels to higher priority sources, and are stored in
+// fixed-size pages of a caller provided buffer, least recently used
+// entries are replaced first.
+//
+// Each second of a frame takes BUS_FREQ*MEMO_NIBBLES/2 bytes, about
+// 62 KB at 25 kHz, and frames that do not fit in the buffer on their
+// own are never cached. The waveform phases and noise are not part of
+// the key, so a cached frame replays the phases it was recorded with
+// and is close to, but not bit-exact with, a rendered frame.
+class Memo {
+private:
+    friend Bus;
+
+    struct Entry {
+        uint32_t key;
+        uint32_t size;
+        uint16_t ticks;
+        uint16_t page;
+        uint16_t age;
+        uint8_t frame;
+
+        NSF::Snapshot exit;
+    };
+
+    uint8_t *_buffer;
+    unsigned _pages;
+    uint16_t _links[MEMO_PAGES];
+    uint16_t _free;
+
+    Entry _entries[MEMO_ENTRIES];
+    uint16_t _clock;
+
+    // Entry being recorded or played back
+    Entry *_entry;
+    uint32_t _pos;
+    uint16_t _page;
+    uint16_t _remaining;
+    uint8_t _last[NSF_APU_CHANNELS];
+    uint8_t _epoch;
+    bool _playing;
+
+    unsigned _hits;
+    unsigned _misses;
+
+    Entry *find(uint8_t frame, uint32_t key);
+    Entry *oldest();
+    void touch(Entry *entry);
+    void release(Entry *entry);
+
+    void tick(NSF *nsf);
+    void read(uint8_t *outputs);
+    void write(const uint8_t *outputs);
+    uint8_t get();
+    void put(uint8_t nibble);
+
+public:
+    // Memo lifetime, the buffer sets the memory budget
+    Memo(uint8_t *buffer, unsigned size);
+
+    // Drop all cached frames
+    void flush();
+
+    // Number of frames copied from and added to the cache
+    unsigned hits();
+    unsigned misses();
+};
+
+
+}
+
+#endif
+
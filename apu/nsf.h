@@ -6,55 +6,172 @@
 #define NSF_H
 
 #include "apu/apu.h"
+#include "apu/format.h"
+#include "apu/log.h"
+#include "apu/expansion.h"
+#include "apu/storage.h"
 #include "mbed-drivers/Ticker.h"
+#include <atomic>
 
 namespace apu {
 
 
-// NSF Engine settings
-#define NSF_FREQ 60
-#define NSF_CHANNELS 4
-#define NSF_SEQUENCES 5
+// NSF Engine settings, the song data layout is in apu/format.h
+#define NSF_LFOS 2
+#define NSF_SNAPSHOTS 2
+
+// Expansion chips compiled into the player, songs using them
+// only play their expansion channels when attached to a bus
+#ifndef NSF_VRC6
+#define NSF_VRC6 0
+#endif
+
+#ifndef NSF_N163
+#define NSF_N163 0
+#endif
+
+#define NSF_CHANNELS (NSF_APU_CHANNELS \
+        + (NSF_VRC6 ? 3 : 0) + (NSF_N163 ? N163_VOICES : 0))
 
 
 // NSF Engine
 class NSF {
 private:
+    friend Bus;
+    friend Memo;
+
+public:
+    // Song header, song data is addressed with 16-bit
+    // NES addresses relative to the start of the data
+    struct Song {
+        const uint8_t *data;
+        Cache *cache;
+
+        uint16_t frames;
+        uint16_t insts;
+
+        uint8_t frame_count;
+        uint8_t pattern_count;
+        uint8_t tick_count;
+
+        // Expansion chips and N163 voices used by the song, these are
+        // not in the song data and set the width of each frame
+        uint8_t expansion;
+        uint8_t voices;
+
+        // Song data access
+        inline uint8_t read(uint16_t addr) const;
+        inline uint16_t lookup(uint16_t addr, unsigned off) const;
+    };
+
+private:
+    // Channel parameters handed to the synthesizer
+    struct State {
+        uint16_t period;
+        int16_t pitch;
+        uint8_t volume;
+        uint8_t duty;
+        uint8_t sweep;
+        uint16_t flags;
+
+#if NSF_N163
+        // N163 wave, packed two samples to a byte
+        uint8_t wave[N163_WAVE_SIZE/2];
+        uint8_t wave_size;
+#endif
+    };
+
+    // Synthesizer changes of one tick handed from the sequencer
+    // to the ticker when sequencing is deferred
+    struct Handoff {
+        State channels[NSF_CHANNELS];
+        uint16_t gain;
+        uint8_t expansion;
+        uint8_t voices;
+        uint8_t flags;
+    };
+
+    // Forwards channel control to the synthesizer, either directly
+    // or through a state snapshot when sequencing is deferred
+    struct Control {
+        apu::Channel *channel;
+        State state;
+        bool deferred;
+        bool voice;
+
+        // Control lifetime
+        Control(apu::Channel *channel);
+
+        // Channel control
+        void enable();
+        void disable();
+        void note(uint8_t note);
+        void adjust_period(uint16_t period);
+        uint16_t get_period();
+        uint16_t to_period(uint8_t note);
+        void volume(uint8_t volume);
+        void pitch(int16_t offset);
+        void duty(uint8_t duty);
+        void sweep(uint8_t sweep);
+#if NSF_N163
+        void wave(const uint8_t *packed, uint8_t size);
+#endif
+
+        // Synchronize the snapshot state with the synthesizer
+        void sync();
+
+        // Apply a snapshot to the synthesizer
+        void apply(const State &state);
+    };
+
     // NSF Channel representation
     struct Channel {
-        uint8_t *_cmds;
+        uint16_t _cmds;
+        uint16_t _slide_target;
+
+        int16_t _pitch;
+        int16_t _mod_pitch;
+
+        struct {
+            uint16_t data;
+            uint8_t count;
+            uint8_t tick;
+            uint8_t repeat;
+        } _seq[NSF_SEQUENCES];
+
+        struct {
+            uint8_t speed;
+            uint8_t depth;
+            uint8_t phase;
+        } _lfo[NSF_LFOS];
 
         bool _enabled;
         uint8_t _note;
         uint8_t _volume;
-        int8_t _offset;
+        uint8_t _envelope;
+        uint8_t _mod_volume;
+        int8_t _volume_slide;
 
         uint8_t _delay;
         uint8_t _pdelay;
         uint8_t _cut;
-
-        uint8_t _sweep;
-        uint8_t _sweep_div;
+        uint8_t _hold;
 
         uint8_t _arpeggio;
         uint8_t _arp_count;
 
         uint8_t _port;
         uint8_t _slide;
-        uint16_t _slide_target;
 
-        struct {
-            uint8_t *data;
-            uint8_t count;
-            uint8_t tick;
-            uint8_t repeat;
-        } _seq[NSF_SEQUENCES];
+        Control _out;
+        NSF *_nsf;
 
-        apu::Channel *_channel;
-        NSF *_nsf; 
+        // Position in the song's frames, NONE if unused by the song
+        uint8_t _slot;
+        bool _n163;
 
         // Channel lifetime
-        Channel(apu::Channel *channel);
+        Channel(apu::Channel *channel=0);
 
         // Reset channel
         void reset();
@@ -64,27 +181,50 @@ private:
         void disable();
 
         // Loads channel setup
-        void frame(uint8_t *frame);
-        void sequence(uint8_t *inst);
+        void frame(uint16_t frame);
+        void sequence(uint16_t inst);
 
         // Channel updates
         void exec();
+        void run();
         void tick();
+        void modulate();
+    };
+
+    // Sequencer and synthesizer state saved by the render cache
+    struct Snapshot {
+        uint8_t frame;
+        uint8_t pattern;
+        uint8_t tick;
+        uint8_t tick_count;
+
+        bool loop;
+        bool halt;
+        uint8_t loops;
+        uint16_t fade;
+        uint16_t gain;
+
+        uint8_t channels[NSF_CHANNELS][sizeof(Channel)];
+        apu::Channel::Snapshot synth[NSF_CHANNELS];
     };
 
     // NSF Engine state
-    uint8_t *_data;
-    uint8_t *_frames;
-    uint8_t *_insts;
+    Song _song;
 
-    unsigned _frame;
-    unsigned _frame_count;
+    uint8_t _frame;
+    uint8_t _pattern;
+    uint8_t _tick;
+    uint8_t _tick_count;
 
-    unsigned _pattern;
-    unsigned _pattern_count;
+    bool _running;
+    bool _loop;
+    bool _halt;
+    uint8_t _epoch;
 
-    unsigned _tick;
-    unsigned _tick_count;
+    uint8_t _loops;
+    uint8_t _loop_limit;
+    uint16_t _fade;
+    uint16_t _fade_count;
 
     // APU Engine
     struct {
@@ -93,6 +233,13 @@ private:
         Triangle triangle;
         Noise    noise;
 
+#if NSF_VRC6
+        VRC6     vrc6;
+#endif
+#if NSF_N163
+        N163     n163;
+#endif
+
         apu::Channel *channels[NSF_CHANNELS];
 
         APU apu;
@@ -102,22 +249,102 @@ private:
     Channel _channels[NSF_CHANNELS];
 
     mbed::Ticker _ticker;
+    Log *_log;
+
+    // Deferred sequencing, ticks are posted as events and the
+    // resulting synthesizer changes are handed back to the ticker,
+    // player changes wait in _post until the next handoff
+    bool _deferred;
+    std::atomic<bool> _stopping;
+    std::atomic<uint8_t> _events;
+    std::atomic<uint8_t> _head;
+    std::atomic<uint8_t> _tail;
+    Handoff _handoffs[NSF_SNAPSHOTS];
+
+    uint8_t _post;
+    uint16_t _post_gain;
+
+    inline uint8_t read(uint16_t addr);
+    inline uint16_t lookup(uint16_t addr, unsigned off);
+
+    void instruments(const Song &song);
+    void prefetch(const Song &song, unsigned frame);
+    void expand(const Song &song);
+    void chips(uint8_t expansion, uint8_t voices);
+    void gain(uint16_t gain);
+
+    void step();
+    void tick();
+    void advance();
+    void end();
 
-    inline uint8_t *lookup(uint8_t *addr, unsigned off);
+    bool entering();
+    uint32_t key();
+    void save(Snapshot &snapshot);
+    void restore(const Snapshot &snapshot);
 
-    void tick();
+protected:
+    // Parse the header of a song
+    void prepare(Song &song, const uint8_t *data, int index,
+            uint8_t expansion=0, uint8_t voices=0);
+    void prepare(Song &song, Cache *cache, int index,
+            uint8_t expansion=0, uint8_t voices=0);
+
+    // Switch to a prepared song at the current tick
+    void play(const Song &song);
+
+    // Called when the song ends, either from a halt command
+    // or after reaching the loop limit, defaults to stopping
+    virtual void finished();
 
 public:
     // NSF lifetime
     NSF(PinName pin=DAC0_OUT);
-
-    // Loads a compiled NSF file
-    void load(uint8_t *data, int song);
-
-    // Starting/stopping the player
+    virtual ~NSF() = default;
+
+    // Loads a compiled NSF file, the data is only read
+    // and may be left in flash
+    //
+    // Songs using expansion chips pass the NSF_EXPANSION flags
+    // and number of N163 voices they were exported with
+    void load(const uint8_t *data, int song,
+            uint8_t expansion=0, uint8_t voices=0);
+
+    // Loads a compiled NSF file from external storage, song data
+    // is streamed in through the cache as it is played
+    //
+    // Storage is never read from interrupt context, so this turns
+    // on deferred sequencing and dispatch must be called to play
+    void load(Cache *cache, int song,
+            uint8_t expansion=0, uint8_t voices=0);
+
+    // Starting/stopping the player, a deferred player stops
+    // on the tick after the next dispatch
     void start();
     void stop();
 
+    // Defer sequencing out of interrupt context, the ticker then only
+    // posts events that are run by calling dispatch from a thread or
+    // event loop, parameter changes take effect on the following tick,
+    // songs streamed from a cache are always deferred
+    //
+    // While deferred, load, limit and stop should be called from the
+    // same thread as dispatch, or while the player is stopped
+    void defer(bool deferred=true);
+
+    // Run pending sequencer ticks, returns the number of ticks run
+    unsigned dispatch();
+
+    // End the song after looping a number of times, 0 loops forever,
+    // the song can optionally fade out over a number of ticks
+    void limit(uint8_t loops, uint16_t fade=0);
+
+    // Record channel control calls into a log, 0 stops recording
+    void record(Log *log);
+
+    // Tap the channel outputs into a scope, 0 removes the tap
+    void scope(Scope *scope);
+
     // Get the current 6-bit amplitude of the APU
     uint8_t output();
 };
@@ -0,0 +1,36 @@
+
+// Note Periods
+//
+
+#ifndef PERIODS_H
+#define PERIODS_H
+
+#include <stdint.h>
+#include "apu/clock.h"
+
+namespace apu {
+
+
+// Period of a note in NES clock cycles for each kind of channel,
+// notes start at A0 and the tables have entries from A1
+class Periods {
+public:
+    // NES channels, noise periods are fixed by the hardware and
+    // the low nibble of the note selects one
+    static uint16_t square(uint8_t note);
+    static uint16_t triangle(uint8_t note);
+    static uint16_t noise(uint8_t note);
+
+    // VRC6 pulse and saw channels
+    static uint16_t pulse(uint8_t note);
+    static uint16_t saw(uint8_t note);
+
+    // N163 voices step through a wave of a number of samples,
+    // 0 if the voice has no wave
+    static uint16_t wave(uint8_t note, uint8_t size);
+};
+
+}
+
+#endif
+
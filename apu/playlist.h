@@ -0,0 +1,79 @@
+
+// NSF Playlist
+//
+
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include "apu/nsf.h"
+#include <atomic>
+
+namespace apu {
+
+
+// Plays a list of songs back to back
+//
+// The next song is prepared ahead of time, and is switched
+// in on the tick the current song ends without restarting
+// the player
+class Playlist : public NSF {
+public:
+    // Playlist entry, either data or cache is used as the song source
+    struct Entry {
+        const uint8_t *data;
+        Cache *cache;
+        int song;
+
+        // Number of loops before moving on, 0 loops forever
+        uint8_t loops;
+
+        // Ticks to fade out over after the last loop
+        uint16_t fade;
+
+        // Expansion flags and N163 voices of the song
+        uint8_t expansion;
+        uint8_t voices;
+    };
+
+private:
+    Entry *_entries;
+    unsigned _count;
+    std::atomic<unsigned> _current;
+
+    // The next song is published to the sequencer through _ready,
+    // it is only written while _ready is clear
+    Song _next;
+    unsigned _next_entry;
+    std::atomic<bool> _ready;
+
+    void prepare(Song &song, unsigned entry);
+    void preload(bool streamed);
+
+protected:
+    virtual void finished();
+
+public:
+    // Playlist lifetime
+    Playlist(Entry *entries, unsigned count, PinName pin=DAC0_OUT);
+
+    // Loads an entry in the playlist
+    void select(unsigned entry);
+
+    // Prepares the next song, should be called outside of
+    // interrupt context while the current song plays, streamed
+    // entries share their cache with the sequencer and are only
+    // preloaded by dispatch
+    void preload();
+
+    // Run pending sequencer ticks and preload the next song
+    unsigned dispatch();
+
+    // Get the entry currently playing
+    unsigned current();
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,63 @@
+
+// Oscilloscope Tap
+//
+
+#ifndef SCOPE_H
+#define SCOPE_H
+
+#include <stdint.h>
+#include <atomic>
+
+namespace apu {
+
+
+// Scope settings, the size must be a power of two
+#define SCOPE_SIZE 256
+
+// Channels tapped, raise to include expansion channels,
+// which follow the APU's own channels
+#ifndef SCOPE_CHANNELS
+#define SCOPE_CHANNELS 4
+#endif
+
+// Channel index of the mixed output
+#define SCOPE_MIX SCOPE_CHANNELS
+
+
+class APU;
+
+// Captures per-channel and mixed samples from an APU
+//
+// The renderer writes into an overwrite ring and never waits on
+// readers. Readers copy out the latest samples and drop any that
+// were overwritten while copying. Expansion chips are rendered a
+// block at a time, so their channels hold the output at the end
+// of each block, the mixed output is exact.
+class Scope {
+private:
+    uint8_t _samples[SCOPE_SIZE][SCOPE_CHANNELS+1];
+    std::atomic<uint32_t> _head;
+
+    uint8_t _decimate;
+    uint8_t _count;
+
+public:
+    // Scope lifetime, only every nth sample is kept
+    Scope(uint8_t decimate=1);
+
+    // Record a sample, called by the renderer
+    void write(APU *apu, uint8_t mix);
+
+    // Copy the latest samples of a channel oldest first, SCOPE_MIX
+    // selects the mixed output, returns the number of samples copied
+    unsigned read(unsigned channel, uint8_t *buffer, unsigned count);
+
+    // Number of samples written so far, wraps around
+    uint32_t position();
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,79 @@
+
+// Song Storage
+//
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace apu {
+
+
+// Storage settings
+#define STORAGE_PAGES 16
+#define STORAGE_PAGE_SIZE 64
+
+
+// Backing storage for song data
+class Storage {
+public:
+    // Storage lifetime
+    virtual ~Storage() = default;
+
+    // Reads data at an offset, returns the number of bytes read
+    virtual unsigned read(uint32_t off, uint8_t *buffer, unsigned size) = 0;
+};
+
+// Song data stored in a file
+class FileStorage : public Storage {
+private:
+    FILE *_file;
+    uint32_t _offset;
+
+public:
+    // FileStorage lifetime
+    FileStorage(FILE *file, uint32_t offset=0);
+
+    // Reads data at an offset, returns the number of bytes read
+    virtual unsigned read(uint32_t off, uint8_t *buffer, unsigned size);
+};
+
+
+// Fixed-size page cache over song storage
+//
+// Pages are keyed by the NES address of the song data,
+// least recently used pages are replaced first
+class Cache {
+private:
+    Storage *_storage;
+
+    uint16_t _tags[STORAGE_PAGES];
+    uint16_t _ages[STORAGE_PAGES];
+    uint16_t _clock;
+    uint8_t _last;
+
+    uint8_t _pages[STORAGE_PAGES][STORAGE_PAGE_SIZE];
+
+    unsigned fetch(uint16_t page);
+
+public:
+    // Cache lifetime
+    Cache(Storage *storage);
+
+    // Drop all cached pages
+    void flush();
+
+    // Read a byte of song data
+    uint8_t read(uint16_t addr);
+
+    // Load the pages covering a range of song data ahead of use
+    void prefetch(uint16_t addr, unsigned size=1);
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,51 @@
+
+// Compile-time Tables
+//
+
+#ifndef TABLES_H
+#define TABLES_H
+
+namespace apu {
+
+
+// Compile-time index sequences
+template <unsigned... I>
+struct Indices {};
+
+template <unsigned N, unsigned... I>
+struct Range : Range<N-1, N-1, I...> {};
+
+template <unsigned... I>
+struct Range<0, I...> {
+    typedef Indices<I...> type;
+};
+
+// Lookup table of N entries generated by a constexpr function
+// F::entry(i), the table is placed in read-only data
+template <typename F, typename I>
+struct TableEntries;
+
+template <typename F, unsigned... I>
+struct TableEntries<F, Indices<I...>> {
+    static constexpr decltype(F::entry(0)) table[] = {F::entry(I)...};
+};
+
+template <typename F, unsigned... I>
+constexpr decltype(F::entry(0)) TableEntries<F, Indices<I...>>::table[];
+
+template <typename F, unsigned N>
+struct Table : TableEntries<F, typename Range<N>::type> {};
+
+
+// Frequency ratio of a number of semitones
+constexpr double semitones(unsigned n) {
+    return n >= 12 ? 2.0 * semitones(n - 12)
+         : n > 0   ? 1.0594630943592953 * semitones(n - 1)
+         : 1.0;
+}
+
+
+}
+
+#endif
+
@@ -0,0 +1,265 @@
+
+// Song Analyzer
+//
+
+#include "apu/analyzer.h"
+#include "apu/periods.h"
+
+using namespace apu;
+
+
+// Largest number of channels in a song, with VRC6 and 8 N163 voices
+#define VOICES 8
+#define CHANNELS (NSF_APU_CHANNELS + 3 + VOICES)
+
+// Notes with entries in the period tables, starting at A1
+#define NOTE_FIRST 9
+#define NOTE_COUNT 87
+
+
+// Song data access
+inline uint8_t Analyzer::read(uint16_t addr) {
+    return _data[addr];
+}
+
+inline uint16_t Analyzer::lookup(uint16_t addr, unsigned off) {
+    return read(addr + 2*off) | (read(addr + 2*off + 1) << 8);
+}
+
+// Find the data following the sequences of an instrument
+uint16_t Analyzer::extra(uint16_t inst) {
+    uint8_t mask = read(inst++);
+
+    for (unsigned i = 0; i < NSF_SEQUENCES; i++) {
+        if (mask & (1 << i)) {
+            inst += 2;
+        }
+    }
+
+    return inst;
+}
+
+// Find the highest note offset of an instrument's arpeggio
+int8_t Analyzer::arpeggio(uint16_t inst) {
+    uint8_t mask = read(inst);
+    if (!(mask & (1 << NSF_SEQ_ARPEGGIO))) return 0;
+
+    uint16_t seq = lookup(inst + 1, (mask & 1) ? 1 : 0);
+    uint8_t count = read(seq);
+    int8_t high = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        int8_t offset = read(seq + 4 + i);
+        if (offset > high) high = offset;
+    }
+
+    return high;
+}
+
+
+// Analyzer lifetime
+Analyzer::Analyzer(const uint8_t *data, uint8_t expansion, uint8_t voices)
+  : _data(data)
+  , _expansion(expansion)
+  , _voices(voices < VOICES ? voices : VOICES) {
+}
+
+// Analyze a song
+Analyzer::Report Analyzer::analyze(int song) {
+    Report report = {};
+
+    uint16_t info = lookup(lookup(0, 0), song);
+    uint16_t frames = lookup(info, 0);
+    uint16_t insts = lookup(0, 1);
+    uint8_t frame_count = read(info + 2);
+    uint8_t pattern_count = read(info + 3);
+
+    // period of a note on each channel, N163 voices
+    // depend on the wave of the instrument instead
+    uint16_t (*synth[CHANNELS])(uint8_t) = {
+        Periods::square,
+        Periods::square,
+        Periods::triangle,
+        Periods::noise,
+    };
+    unsigned count = NSF_APU_CHANNELS;
+
+    if (_expansion & NSF_EXPANSION_VRC6) {
+        synth[count++] = Periods::pulse;
+        synth[count++] = Periods::pulse;
+        synth[count++] = Periods::saw;
+    }
+
+    if (_expansion & NSF_EXPANSION_N163) {
+        for (unsigned i = 0; i < _voices; i++) {
+            synth[count++] = 0;
+        }
+    }
+
+    // channel state carried between frames
+    uint16_t inst[CHANNELS] = {0};
+    uint8_t effect[CHANNELS] = {0};
+    uint16_t periods[CHANNELS] = {0};
+
+    for (unsigned frame = 0; frame < frame_count; frame++) {
+        uint16_t patterns = lookup(frames, frame);
+        uint16_t cmds[CHANNELS];
+        uint8_t delay[CHANNELS];
+        uint8_t pdelay[CHANNELS];
+
+        for (unsigned i = 0; i < count; i++) {
+            // expansion channels follow the DPCM channel
+            cmds[i] = lookup(patterns, i < NSF_SLOT_DPCM ? i : i+1);
+            delay[i] = 0;
+            pdelay[i] = 0xff;
+        }
+
+        unsigned frame_instruments = 0;
+        bool skip = false;
+
+        for (unsigned row = 0; row < pattern_count && !skip; row++) {
+            unsigned row_commands = 0;
+            unsigned row_instruments = 0;
+
+            for (unsigned i = 0; i < count; i++) {
+                if (delay[i]) {
+                    delay[i]--;
+                    continue;
+                }
+
+                uint8_t cmd;
+                unsigned limit = 0x100;
+
+                do {
+                    cmd = read(cmds[i]++);
+                    row_commands++;
+
+                    int note = -1;
+
+                    if ((cmd & 0x80) == 0x00) { // notes
+                        if (cmd != 0x00 && cmd != 0x7f) {
+                            note = cmd-1;
+                        }
+                    } else if (cmd < 0xb0) { // other commands
+                        uint8_t arg = read(cmds[i]++);
+
+                        if (cmd == 0x80) {
+                            inst[i] = lookup(insts, arg);
+                            row_instruments++;
+                        } else if (cmd == 0x84 || cmd == 0x86) {
+                            skip = true;
+                        } else if (cmd == 0x94) {
+                            effect[i] = (arg >> 4) > (arg & 0xf)
+                                    ? arg >> 4 : arg & 0xf;
+                        } else if (cmd == 0xa4) {
+                            // the slide target is found from the note
+                            effect[i] = arg & 0xf;
+                        }
+                    } else if ((cmd & 0xf0) == 0xe0) { // change instrument
+                        inst[i] = lookup(insts, cmd & 0xf);
+                        row_instruments++;
+                    } else if (cmd == 0xb0) { // set delay
+                        pdelay[i] = read(cmds[i]++);
+                    } else if (cmd == 0xb2) { // reset delay
+                        pdelay[i] = 0xff;
+                    }
+
+                    if (note < 0) continue;
+
+                    // highest note reached by the arpeggios
+                    int8_t high = inst[i] ? arpeggio(inst[i]) : 0;
+                    if (effect[i] > high) high = effect[i];
+                    note += high;
+
+                    if (i != NSF_SLOT_NOISE && (note < NOTE_FIRST
+                            || note - NOTE_FIRST >= NOTE_COUNT)) {
+                        continue;
+                    }
+
+                    // periods out of range stop the channel
+                    uint16_t period;
+                    if (!synth[i]) {
+                        uint8_t size = inst[i] ? read(extra(inst[i])) : 0;
+                        period = Periods::wave(note,
+                                size < N163_WAVE_SIZE ? size : N163_WAVE_SIZE);
+                    } else {
+                        period = synth[i](note);
+                    }
+                    if (period > 0xfff || period <= 8) continue;
+
+                    if (!periods[i] || period < periods[i]) {
+                        periods[i] = period;
+                    }
+                } while ((cmd & 0x80) && --limit);
+
+                delay[i] = pdelay[i] == 0xff ? read(cmds[i]++) : pdelay[i];
+            }
+
+            if (row_commands > report.row_commands) {
+                report.row_commands = row_commands;
+            }
+
+            if (row_instruments > report.row_instruments) {
+                report.row_instruments = row_instruments;
+            }
+
+            frame_instruments += row_instruments;
+        }
+
+        if (frame_instruments > report.frame_instruments) {
+            report.frame_instruments = frame_instruments;
+        }
+    }
+
+    // channel timer edges with every channel at its shortest period
+    for (unsigned i = 0; i < count; i++) {
+        if (!periods[i]) continue;
+
+        if (!report.min_period || periods[i] < report.min_period) {
+            report.min_period = periods[i];
+        }
+
+        report.edges += APU_FREQ / (APU_FRAME_FREQ * periods[i]);
+    }
+
+    report.tick_cycles = ANALYZER_TICK_CYCLES
+            + count * ANALYZER_CHANNEL_CYCLES
+            + report.row_commands * ANALYZER_COMMAND_CYCLES
+            + report.row_instruments * ANALYZER_INSTRUMENT_CYCLES;
+
+    report.frame_cycles = report.tick_cycles
+            + report.edges * ANALYZER_EDGE_CYCLES;
+
+    return report;
+}
+
+// Recommended depth of the output buffer
+unsigned Analyzer::depth(const Report &report, uint32_t clock) {
+    unsigned budget = clock / BUS_FREQ;
+    unsigned samples = BUS_FREQ / APU_FRAME_FREQ;
+
+    // steady cost of each sample with the channel
+    // timer edges spread over the tick
+    unsigned steady = ANALYZER_SAMPLE_CYCLES
+            + (report.edges * ANALYZER_EDGE_CYCLES + samples-1) / samples;
+
+    if (steady >= budget) return 0;
+
+    // the rest of each sample pays back the costliest tick
+    // before the next one
+    unsigned spare = budget - steady;
+    if (report.tick_cycles > spare * samples) return 0;
+
+    // samples played out while catching up on the tick, plus
+    // the block being rendered, rounded up to a size the bus
+    // buffer can wrap on
+    unsigned late = (report.tick_cycles + spare-1) / spare;
+    unsigned depth = BUS_BLOCK;
+
+    while (depth < late + BUS_BLOCK) {
+        depth <<= 1;
+    }
+
+    return depth;
+}
+
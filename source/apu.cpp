@@ -3,6 +3,9 @@
 //
 
 #include "apu/apu.h"
+#include "apu/log.h"
+#include "apu/scope.h"
+#include "apu/expansion.h"
 
 using namespace apu;
 
@@ -11,9 +14,17 @@ using namespace apu;
 APU::APU(Channel **channels, unsigned count, PinName pin)
   : _channels(channels)
   , _count(count)
-  , _dac(pin) {
+  , _gain(0x100)
+  , _dac(pin)
+  , _bus(0)
+  , _log(0)
+  , _scope(0)
+  , _expansion(0)
+  , _phase(0)
+  , _step(0) {
     for (unsigned i = 0; i < _count; i++) {
         _channels[i]->_apu = this;
+        _channels[i]->_index = i;
     }
 }
 
@@ -26,52 +37,203 @@ void APU::update() {
         output += _channels[i]->output();
     }
 
+    if (_gain != 0x100) {
+        output = (output * _gain) >> 8;
+    }
+
     if (output > 0x3f) output = 0x3f;
     _output = output;
     _dac.write_u16(output << 10);
+
+    if (_scope) {
+        _scope->write(this, output);
+    }
+}
+
+// Advance the frame sequencer by a number of NES clock cycles
+unsigned APU::sequence(unsigned cycles) {
+    unsigned frames = 0;
+    _phase += cycles * APU_SEQUENCER_FREQ;
+
+    while (_phase >= APU_FREQ) {
+        _phase -= APU_FREQ;
+        frames += step();
+    }
+
+    return frames;
+}
+
+// Clock the frame sequencer by a quarter frame
+bool APU::step() {
+    bool half = _step & 1;
+
+    for (unsigned i = 0; i < _count; i++) {
+        _channels[i]->quarter_frame();
+
+        if (half) {
+            _channels[i]->half_frame();
+        }
+    }
+
+    _step = (_step + 1) & 0x3;
+    return _step == 0;
+}
+
+
+// Set the master gain, 0x100 is unity
+void APU::gain(uint16_t gain) {
+    _gain = gain;
+}
+
+// Record channel control calls into a log, 0 stops recording
+void APU::record(Log *log) {
+    _log = log;
+}
+
+// Tap the channel outputs into a scope, 0 removes the tap
+void APU::scope(Scope *scope) {
+    _scope = scope;
+}
+
+// Add an expansion chip, 0 removes all expansions
+void APU::expand(Expansion *expansion) {
+    if (!expansion) {
+        for (Expansion *e = _expansion; e; e = e->_next) {
+            for (unsigned i = 0; i < e->count(); i++) {
+                e->channel(i)->_apu = 0;
+            }
+        }
+
+        _expansion = 0;
+        return;
+    }
+
+    unsigned index = _count;
+    Expansion **last = &_expansion;
+    while (*last) {
+        if (*last == expansion) return;
+        index += (*last)->count();
+        last = &(*last)->_next;
+    }
+
+    expansion->_next = 0;
+    *last = expansion;
+
+    for (unsigned i = 0; i < expansion->count(); i++) {
+        expansion->channel(i)->_apu = this;
+        expansion->channel(i)->_index = index + i;
+    }
+}
+
+// Find a channel, expansion channels follow the APU's own
+Channel *APU::find(unsigned channel) {
+    if (channel < _count) {
+        return _channels[channel];
+    }
+
+    channel -= _count;
+
+    for (Expansion *e = _expansion; e; e = e->_next) {
+        if (channel < e->count()) {
+            return e->channel(channel);
+        }
+
+        channel -= e->count();
+    }
+
+    return 0;
 }
 
 
 // Enable/disable specified channel
 void APU::enable(unsigned channel) {
-    if (channel >= _count) return;
-    _channels[channel]->enable();
+    Channel *c = find(channel);
+    if (!c) return;
+    c->enable();
 }
 
 void APU::disable(unsigned channel) {
-    if (channel >= _count) return;
-    _channels[channel]->disable();
+    Channel *c = find(channel);
+    if (!c) return;
+    c->disable();
 }
 
 // Set the note being played by a channel
 // Note value starts at A0
 void APU::note(unsigned channel, uint8_t note) {
-    if (channel >= _count) return;
-    _channels[channel]->note(note);
+    Channel *c = find(channel);
+    if (!c) return;
+    c->note(note);
 }
 
 // Sets the period being played by the channel directly
 // Period is based on NES clock cycles
 void APU::period(unsigned channel, uint16_t period) {
-    if (channel >= _count) return;
-    _channels[channel]->set_period(period);
+    Channel *c = find(channel);
+    if (!c) return;
+    c->set_period(period);
+}
+
+// Adjust period without timer reset
+void APU::adjust(unsigned channel, uint16_t period) {
+    Channel *c = find(channel);
+    if (!c) return;
+    c->adjust_period(period);
 }
 
 // Set the volume of a channel
 void APU::volume(unsigned channel, uint8_t volume) {
-    if (channel >= _count) return;
-    _channels[channel]->volume(volume);
+    Channel *c = find(channel);
+    if (!c) return;
+    c->volume(volume);
 }
 
 // Set the pitch offset of a channel
 void APU::pitch(unsigned channel, int16_t offset) {
-    if (channel >= _count) return;
-    _channels[channel]->pitch(offset);
+    Channel *c = find(channel);
+    if (!c) return;
+    c->pitch(offset);
 }
 
 // Set the duty cycle of a channel
 void APU::duty(unsigned channel, uint8_t duty) {
-    if (channel >= _count) return;
-    _channels[channel]->duty(duty);
+    Channel *c = find(channel);
+    if (!c) return;
+    c->duty(duty);
+}
+
+
+// Start a volume envelope on a channel
+void APU::envelope(unsigned channel, uint8_t period, bool loop) {
+    Channel *c = find(channel);
+    if (!c) return;
+    c->envelope(period, loop);
 }
 
+// Set the length counter of a channel
+void APU::length(unsigned channel, uint8_t index) {
+    Channel *c = find(channel);
+    if (!c) return;
+    c->length(index);
+}
+
+// Set the sweep unit of a channel
+void APU::sweep(unsigned channel, uint8_t sweep) {
+    Channel *c = find(channel);
+    if (!c) return;
+    c->sweep(sweep);
+}
+
+
+// Load a wave into a channel
+void APU::wave(unsigned channel, const uint8_t *packed, uint8_t size) {
+    Channel *c = find(channel);
+    if (!c) return;
+    c->wave(packed, size);
+}
+
+
+// Get the current amplitude of the APU
+uint8_t APU::output() {
+    return _output;
+}
@@ -0,0 +1,351 @@
+
+// Mixing Bus
+//
+
+#include "apu/bus.h"
+#include "apu/scope.h"
+#include "apu/expansion.h"
+
+using namespace apu;
+
+
+// NES clock cycles per output sample
+#define CYCLES (APU_FREQ / BUS_FREQ)
+#define CYCLES_REM (APU_FREQ % BUS_FREQ)
+
+
+// Bus lifetime
+Bus::Bus(PinName pin, uint8_t *buffer, unsigned size)
+  : _count(0)
+  , _cycles(0)
+  , _buffer(_block)
+  , _size(BUS_BLOCK)
+  , _ahead(false)
+  , _last(0)
+  , _head(0)
+  , _tail(0)
+  , _dac(pin) {
+
+    // the ring wraps on a power of two
+    while (size & (size-1)) {
+        size &= size-1;
+    }
+
+    if (buffer && size >= BUS_BLOCK) {
+        _buffer = buffer;
+        _size = size;
+        _ahead = true;
+    }
+}
+
+
+// Attach a source
+bool Bus::attach(APU *apu, NSF *nsf, Replay *replay,
+        uint16_t gain, uint8_t priority) {
+    if (_count >= BUS_SOURCES || apu->_bus) {
+        return false;
+    }
+
+    // keep sources sorted by priority
+    unsigned i = _count++;
+    while (i > 0 && _sources[i-1].priority < priority) {
+        _sources[i] = _sources[i-1];
+        i--;
+    }
+
+    _sources[i].apu = apu;
+    _sources[i].nsf = nsf;
+    _sources[i].replay = replay;
+    _sources[i].memo = 0;
+    _sources[i].gain = gain;
+    _sources[i].priority = priority;
+
+    // take over the source's timers
+    apu->_bus = this;
+
+    for (unsigned j = 0; j < apu->_count; j++) {
+        Channel *channel = apu->_channels[j];
+        channel->detach();
+        channel->_timer = channel->_period + channel->_pitch;
+    }
+
+    if (nsf) {
+        nsf->_ticker.detach();
+    }
+
+    if (replay) {
+        replay->_ticker.detach();
+    }
+
+    return true;
+}
+
+bool Bus::attach(APU *apu, uint16_t gain, uint8_t priority) {
+    return attach(apu, 0, 0, gain, priority);
+}
+
+bool Bus::attach(NSF *nsf, uint16_t gain, uint8_t priority) {
+    return attach(&nsf->_apu.apu, nsf, 0, gain, priority);
+}
+
+bool Bus::attach(Replay *replay, uint16_t gain, uint8_t priority) {
+    return attach(replay->_apu, 0, replay, gain, priority);
+}
+
+// Detach a source, returning it to its own timers
+void Bus::detach(APU *apu) {
+    Source *source = find(apu);
+    if (!source) return;
+
+    NSF *nsf = source->nsf;
+    Replay *replay = source->replay;
+
+    _count--;
+    for (Source *s = source; s < &_sources[_count]; s++) {
+        s[0] = s[1];
+    }
+
+    apu->_bus = 0;
+
+    for (unsigned j = 0; j < apu->_count; j++) {
+        Channel *channel = apu->_channels[j];
+
+        if (channel->_period) {
+            channel->retick(channel->_period + channel->_pitch);
+        }
+    }
+
+    if (nsf && nsf->_running) {
+        nsf->_ticker.attach_us(nsf, &NSF::step, 1000000/APU_SEQUENCER_FREQ);
+    }
+
+    if (replay && replay->_running) {
+        replay->_ticker.attach_us(replay, &Replay::step,
+                1000000/APU_SEQUENCER_FREQ);
+    }
+}
+
+void Bus::detach(NSF *nsf) {
+    detach(&nsf->_apu.apu);
+}
+
+void Bus::detach(Replay *replay) {
+    detach(replay->_apu);
+}
+
+// Find the source for an APU
+Bus::Source *Bus::find(APU *apu) {
+    for (unsigned i = 0; i < _count; i++) {
+        if (_sources[i].apu == apu) {
+            return &_sources[i];
+        }
+    }
+
+    return 0;
+}
+
+// Set the gain of a source
+void Bus::gain(APU *apu, uint16_t gain) {
+    Source *source = find(apu);
+    if (!source) return;
+
+    source->gain = gain;
+}
+
+void Bus::gain(NSF *nsf, uint16_t gain) {
+    Bus::gain(&nsf->_apu.apu, gain);
+}
+
+// Cache the rendered frames of a song, 0 stops caching
+void Bus::memoize(NSF *nsf, Memo *memo) {
+    Source *source = find(&nsf->_apu.apu);
+    if (!source) return;
+
+    if (memo) {
+        memo->flush();
+    }
+
+    source->memo = memo;
+}
+
+
+// Render 6-bit samples at BUS_FREQ
+void Bus::render(uint8_t *buffer, unsigned count) {
+    uint16_t samples[BUS_BLOCK];
+    uint8_t cycles[BUS_BLOCK];
+
+    for (unsigned off = 0; off < count; off += BUS_BLOCK) {
+        unsigned size = count - off < BUS_BLOCK ? count - off : BUS_BLOCK;
+
+        // NES clock cycles in each sample
+        for (unsigned n = 0; n < size; n++) {
+            cycles[n] = CYCLES;
+            _cycles += CYCLES_REM;
+            if (_cycles >= BUS_FREQ) {
+                _cycles -= BUS_FREQ;
+                cycles[n]++;
+            }
+        }
+
+        // expansion chips are rendered a block at a time ahead of
+        // the sources' own channels, so the output and scope of
+        // each source include them
+        for (unsigned s = 0; s < _count; s++) {
+            APU *apu = _sources[s].apu;
+            if (!apu->_expansion) continue;
+
+            uint16_t *block = _sources[s].expansion;
+
+            for (unsigned n = 0; n < size; n++) {
+                block[n] = 0;
+            }
+
+            for (Expansion *e = apu->_expansion; e; e = e->_next) {
+                e->render(block, cycles, size);
+            }
+        }
+
+        for (unsigned n = 0; n < size; n++) {
+            samples[n] = mix(cycles[n], n);
+        }
+
+        for (unsigned n = 0; n < size; n++) {
+            buffer[off + n] = samples[n] > 0x3f ? 0x3f : samples[n];
+        }
+    }
+}
+
+// Mix one sample of the sources, n is the sample's
+// position in the block of expansion output
+unsigned Bus::mix(unsigned cycles, unsigned n) {
+    // mix sources, playing channels take over the
+    // same channel in lower priority sources
+    unsigned taken = 0;
+    unsigned output = 0;
+
+    for (unsigned s = 0; s < _count; s++) {
+        APU *apu = _sources[s].apu;
+        NSF *nsf = _sources[s].nsf;
+        Replay *replay = _sources[s].replay;
+        Memo *memo = _sources[s].memo;
+        unsigned sum = 0;
+
+        // step the frame sequencer, NSF engines and
+        // replays advance at the end of each frame
+        unsigned frames = apu->sequence(cycles);
+
+        for (; frames && nsf && nsf->_running; frames--) {
+            if (memo) {
+                memo->tick(nsf);
+            } else {
+                nsf->tick();
+            }
+        }
+
+        for (; frames && replay && replay->_running; frames--) {
+            replay->advance();
+        }
+
+        if (memo && memo->_playing && nsf->_running) {
+            // cached frames hold the output of each channel
+            // marked with whether it was playing
+            uint8_t outputs[NSF_APU_CHANNELS];
+            memo->read(outputs);
+
+            for (unsigned i = 0; i < NSF_APU_CHANNELS; i++) {
+                if (taken & (1 << i)) continue;
+
+                if (outputs[i] & MEMO_PLAYING) {
+                    taken |= 1 << i;
+                }
+
+                sum += outputs[i] & ~MEMO_PLAYING;
+            }
+        } else {
+            uint8_t outputs[NSF_APU_CHANNELS];
+
+            for (unsigned i = 0; i < apu->_count; i++) {
+                Channel *channel = apu->_channels[i];
+                channel->clock(cycles);
+
+                if (memo) {
+                    outputs[i] = channel->_output
+                            | (channel->_period ? MEMO_PLAYING : 0);
+                }
+
+                if (taken & (1 << i)) continue;
+
+                if (channel->_period) {
+                    taken |= 1 << i;
+                }
+
+                sum += channel->_output;
+            }
+
+            if (memo) {
+                memo->write(outputs);
+            }
+        }
+
+        if (apu->_expansion) {
+            sum += _sources[s].expansion[n];
+        }
+
+        apu->_output = sum > 0x3f ? 0x3f : sum;
+
+        if (apu->_scope) {
+            apu->_scope->write(apu, apu->_output);
+        }
+
+        output += (((sum * _sources[s].gain) >> 8) * apu->_gain) >> 8;
+    }
+
+    return output;
+}
+
+// Output timer
+void Bus::sample() {
+    unsigned tail = _tail.load(std::memory_order_relaxed);
+    unsigned head = _head.load(std::memory_order_acquire);
+
+    if (tail == head) {
+        // a buffer rendered ahead has run dry
+        if (_ahead) {
+            _dac.write_u16(_last << 10);
+            return;
+        }
+
+        render(&_buffer[head & (_size-1)], BUS_BLOCK);
+        _head.store(head + BUS_BLOCK, std::memory_order_relaxed);
+    }
+
+    _last = _buffer[tail & (_size-1)];
+    _tail.store(tail + 1, std::memory_order_release);
+    _dac.write_u16(_last << 10);
+}
+
+// Render ahead into the buffer until it is full
+unsigned Bus::fill() {
+    if (!_ahead) return 0;
+
+    unsigned count = 0;
+    unsigned head = _head.load(std::memory_order_relaxed);
+
+    while (head - _tail.load(std::memory_order_acquire) + BUS_BLOCK <= _size) {
+        render(&_buffer[head & (_size-1)], BUS_BLOCK);
+        head += BUS_BLOCK;
+        _head.store(head, std::memory_order_release);
+        count += BUS_BLOCK;
+    }
+
+    return count;
+}
+
+// Starting/stopping the output timer
+void Bus::start() {
+    _ticker.attach_us(this, &Bus::sample, 1000000/BUS_FREQ);
+}
+
+void Bus::stop() {
+    _ticker.detach();
+}
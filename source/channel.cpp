@@ -3,6 +3,8 @@
 //
 
 #include "apu/apu.h"
+#include "apu/log.h"
+#include "apu/periods.h"
 
 using namespace apu;
 
@@ -22,26 +24,20 @@ const static unsigned char SQUARE[4][8] = {
 };
 
 
-// Period lookup table
-const static unsigned short PTABLE[] = {
-    0x7f1, 0x77f, 0x713, 0x6ad, 0x64d, 0x5f3, 0x59d, 0x54c,
-    0x500, 0x4b8, 0x474, 0x434, 0x3f8, 0x3bf, 0x389, 0x356,
-    0x326, 0x2f9, 0x2ce, 0x2a6, 0x280, 0x25c, 0x23a, 0x21a,
-    0x1fb, 0x1df, 0x1c4, 0x1ab, 0x193, 0x17c, 0x167, 0x152,
-    0x13f, 0x12d, 0x11c, 0x10c, 0xfd,  0xef,  0xe1,  0xd5,
-    0xc9,  0xbd,  0xb3,  0xa9,  0x9f,  0x96,  0x8e,  0x86,
-    0x7e,  0x77,  0x70,  0x6a,  0x64,  0x5e,  0x59,  0x54,
-    0x4f,  0x4b,  0x46,  0x42,  0x3f,  0x3b,  0x38,  0x34,
-    0x31,  0x2f,  0x2c,  0x29,  0x27,  0x25,  0x23,  0x21,
-    0x1f,  0x1d,  0x1b,  0x1a,  0x18,  0x17,  0x15,  0x14,
-    0x13,  0x12,  0x11,  0x10,  0xf,   0xe,   0xd,   0x0
+// Length counter lookup table, these are fixed by the hardware
+const static unsigned char LENGTH[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
 };
 
-// Noise period lookup table
-const static unsigned short NTABLE[] = {
-    0xfe4, 0x7f2, 0x3f8, 0x2fa, 0x1fc, 0x17c, 0xfe, 0xca,
-    0xa0,  0x80,  0x60,  0x40,  0x20,  0x10,  0x8,  0x4
-};
+// Envelope flags, the low nibble holds the period
+#define ENVELOPE_LOOP  0x10
+#define ENVELOPE_ON    0x20
+#define ENVELOPE_START 0x40
+
+// Conversion from NES clock cycles to microseconds in 16.16 fixed point
+constexpr static unsigned US_SCALE =
+        ((unsigned long long)1000000 << 16) / APU_FREQ;
 
 
 
@@ -49,15 +45,76 @@ const static unsigned short NTABLE[] = {
 
 // Channel lifetime
 Channel::Channel()
-  : _output(0)
-  , _period(0xfff)
-  , _volume(15) {
+  : _apu(0)
+  , _timer(0)
+  , _period(0)
+  , _pitch(0)
+  , _tick(0)
+  , _output(0)
+  , _duty(0)
+  , _volume(15)
+  , _update(false)
+  , _envelope(0)
+  , _divider(0)
+  , _decay(0)
+  , _length(0)
+  , _length_load(0xff)
+  , _sweep(0)
+  , _sweep_divider(0)
+  , _sweep_reload(false) {
 }
 
 
 // Emulate a channel
 void Channel::retick(unsigned us) {
-    _ticker.attach_us(this, &Channel::tick, us*1000000 / APU_FREQ);
+    _timer = us;
+}
+
+void Channel::detach() {
+}
+
+void TickerChannel::retick(unsigned us) {
+    if (_apu && _apu->_bus) {
+        _timer = us;
+        return;
+    }
+
+    _ticker.attach_us(static_cast<Channel *>(this), &Channel::tick,
+            (us*US_SCALE) >> 16);
+}
+
+void TickerChannel::detach() {
+    _ticker.detach();
+}
+
+void Channel::reperiod(uint16_t period) {
+    _period = period;
+
+    if (period > 0xfff || period <= 8) {
+        stop();
+    } else {
+        retick(_period + _pitch);
+    }
+}
+
+// Restart the envelope and length counter on a new note
+void Channel::reload() {
+    _envelope |= ENVELOPE_START;
+
+    if (_length_load < sizeof LENGTH) {
+        _length = LENGTH[_length_load];
+    }
+}
+
+void Channel::stop() {
+    _period = 0;
+    detach();
+}
+
+void Channel::record(uint8_t cmd, uint16_t arg, const uint8_t *data) {
+    if (_apu && _apu->_log) {
+        _apu->_log->write(cmd, _index, arg, data);
+    }
 }
 
 void Channel::tick() {
@@ -70,43 +127,61 @@ void Channel::tick() {
     _apu->update();
 }
 
+// Advance the channel by a number of NES clock cycles
+void Channel::clock(unsigned cycles) {
+    if (!_period) return;
+
+    _timer -= cycles;
+
+    while (_timer <= 0) {
+        int period = _period + _pitch;
+        _timer += period > 0 ? period : 1;
+        update();
+    }
+}
+
 // Enable/disable specified channel
 void Channel::enable() {
+    record(LOG_ENABLE);
+    reload();
     _period = 0xfff;
     retick(_period + _pitch);
 }
 
 void Channel::disable() {
-    _period = 0;
-    _ticker.detach();
+    record(LOG_DISABLE);
+    stop();
 }
 
 
 // Set the note being played by a channel
 // Note value starts at A0
 void Channel::note(uint8_t note) {
-    set_period(to_period(note));
+    record(LOG_NOTE, note);
+    reload();
+    reperiod(to_period(note));
 }
 
 // Sets the period being played by the channel directly
 // Period is based on NES clock cycles
 void Channel::set_period(uint16_t period) {
-    _period = period;
-
-    if (period > 0xfff || period <= 8) {
-        disable();
-    } else {
-        retick(_period + _pitch);
-    }
+    record(LOG_PERIOD, period);
+    reload();
+    reperiod(period);
 }
 
 // Adjust period without timer reset
 void Channel::adjust_period(uint16_t period) {
+    record(LOG_ADJUST, period);
+
+    // a stopped channel stays stopped until it is enabled
+    if (!_period) return;
+
     _period = period;
     _update = true;
 
     if (period > 0xfff || period <= 8) {
-        disable();
+        stop();
     }
 }
 
@@ -117,30 +192,155 @@ uint16_t Channel::get_period() {
 
 // Set the volume of a channel
 void Channel::volume(uint8_t volume) {
+    record(LOG_VOLUME, volume);
+    _envelope &= ~ENVELOPE_ON;
     _volume = volume;
 }
 
 // Set the pitch offset of a channel
 void Channel::pitch(int16_t offset) {
+    record(LOG_PITCH, offset);
     _pitch = offset;
     _update = true;
 }
 
 // Set the duty cycle of a channel
 void Channel::duty(uint8_t duty) {
+    record(LOG_DUTY, duty);
     _duty = duty;
 }
 
+// Decay the volume over a number of quarter frames
+void Channel::envelope(uint8_t period, bool loop) {
+    record(LOG_ENVELOPE, (period & 0xf) | (loop ? ENVELOPE_LOOP : 0));
+    _envelope = (period & 0xf) | (loop ? ENVELOPE_LOOP : 0)
+              | ENVELOPE_ON | ENVELOPE_START;
+}
+
+// Silence the channel after a number of half frames
+void Channel::length(uint8_t index) {
+    record(LOG_LENGTH, index);
+    _length_load = index;
+    _length = index < sizeof LENGTH ? LENGTH[index] : 0;
+}
+
+// Sweep the period every half frame
+void Channel::sweep(uint8_t sweep) {
+    record(LOG_SWEEP, sweep);
+    _sweep = sweep;
+    _sweep_reload = true;
+}
+
+// Channels without a wavetable ignore waves
+void Channel::wave(const uint8_t *, uint8_t) {
+}
+
+// Frame sequencer clocks
+void Channel::quarter_frame() {
+    if (!(_envelope & ENVELOPE_ON)) return;
+
+    if (_envelope & ENVELOPE_START) {
+        _envelope &= ~ENVELOPE_START;
+        _divider = _envelope & 0xf;
+        _decay = 15;
+    } else if (_divider) {
+        _divider--;
+    } else {
+        _divider = _envelope & 0xf;
+
+        if (_decay) {
+            _decay--;
+        } else if (_envelope & ENVELOPE_LOOP) {
+            _decay = 15;
+        }
+    }
+
+    _volume = _decay;
+}
+
+void Channel::half_frame() {
+    if (_length && !(--_length)) {
+        stop();
+    }
+
+    if (!(_sweep & 0x80)) return;
+
+    if (!_sweep_divider && (_sweep & 0x7) && _period) {
+        uint16_t target = _period;
+
+        if (_sweep & 0x8) {
+            target -= target >> (_sweep & 0x7);
+        } else {
+            target += target >> (_sweep & 0x7);
+        }
+
+        if (target > 0xfff || target <= 8) {
+            _sweep = 0;
+            stop();
+        } else {
+            _period = target;
+            _update = true;
+        }
+    }
+
+    if (!_sweep_divider || _sweep_reload) {
+        _sweep_divider = (_sweep >> 4) & 0x7;
+        _sweep_reload = false;
+    } else {
+        _sweep_divider--;
+    }
+}
+
 // Get the output of a channel
 uint8_t Channel::output() {
     return _output;
 }
 
+// Save/restore the synthesis state
+void Channel::save(Snapshot &snapshot) {
+    snapshot.timer = _timer;
+    snapshot.period = _period;
+    snapshot.pitch = _pitch;
+    snapshot.tick = _tick;
+    snapshot.output = _output;
+    snapshot.duty = _duty;
+    snapshot.volume = _volume;
+    snapshot.shift = 0;
+
+    snapshot.envelope = _envelope;
+    snapshot.divider = _divider;
+    snapshot.decay = _decay;
+    snapshot.length = _length;
+    snapshot.length_load = _length_load;
+    snapshot.sweep = _sweep;
+    snapshot.sweep_divider = _sweep_divider;
+    snapshot.sweep_reload = _sweep_reload;
+}
+
+void Channel::restore(const Snapshot &snapshot) {
+    _timer = snapshot.timer;
+    _period = snapshot.period;
+    _pitch = snapshot.pitch;
+    _tick = snapshot.tick;
+    _output = snapshot.output;
+    _duty = snapshot.duty;
+    _volume = snapshot.volume;
+
+    _envelope = snapshot.envelope;
+    _divider = snapshot.divider;
+    _decay = snapshot.decay;
+    _length = snapshot.length;
+    _length_load = snapshot.length_load;
+    _sweep = snapshot.sweep;
+    _sweep_divider = snapshot.sweep_divider;
+    _sweep_reload = snapshot.sweep_reload;
+}
+
 
 
 // Square channel
 uint16_t Square::to_period(uint8_t note) {
-    return PTABLE[note - 9] << 1;
+    return Periods::square(note);
 }
 
 void Square::update() {
@@ -151,7 +351,7 @@ void Square::update() {
 
 // Triangle channel
 uint16_t Triangle::to_period(uint8_t note) {
-    return PTABLE[note - 9];
+    return Periods::triangle(note);
 }
 
 void Triangle::update() {
@@ -162,7 +362,7 @@ void Triangle::update() {
 
 // Noise channel
 uint16_t Noise::to_period(uint8_t note) {
-    return NTABLE[note & 0xf];
+    return Periods::noise(note);
 }
 
 void Noise::update() {
@@ -171,3 +371,13 @@ void Noise::update() {
     _output = (_volume/2) * _tick;
 }
 
+void Noise::save(Snapshot &snapshot) {
+    Channel::save(snapshot);
+    snapshot.shift = _shift;
+}
+
+void Noise::restore(const Snapshot &snapshot) {
+    Channel::restore(snapshot);
+    _shift = snapshot.shift;
+}
+
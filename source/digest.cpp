@@ -0,0 +1,41 @@
+
+// Output Digest
+//
+
+#include "apu/digest.h"
+
+using namespace apu;
+
+
+// Digest lifetime
+Digest::Digest() {
+    reset();
+}
+
+// Start a new digest
+void Digest::reset() {
+    _hash = DIGEST_BASIS;
+    _size = 0;
+}
+
+// Add data to the digest
+void Digest::update(const uint8_t *data, unsigned size) {
+    uint32_t hash = _hash;
+
+    for (unsigned i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * DIGEST_PRIME;
+    }
+
+    _hash = hash;
+    _size += size;
+}
+
+// Get the current hash
+uint32_t Digest::value() {
+    return _hash;
+}
+
+// Number of bytes hashed
+uint32_t Digest::size() {
+    return _size;
+}
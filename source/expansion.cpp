@@ -0,0 +1,191 @@
+
+// Expansion Audio
+//
+
+#include "apu/expansion.h"
+#include "apu/periods.h"
+#include "apu/log.h"
+
+using namespace apu;
+
+
+// Expansion lifetime
+Expansion::Expansion()
+  : _next(0) {
+}
+
+
+// VRC6 channels
+uint16_t VRC6::Pulse::to_period(uint8_t note) {
+    return Periods::pulse(note);
+}
+
+void VRC6::Pulse::update() {
+    _output = _tick <= _duty ? _volume : 0;
+    _tick = (_tick+1) & 0xf;
+}
+
+uint16_t VRC6::Saw::to_period(uint8_t note) {
+    return Periods::saw(note);
+}
+
+void VRC6::Saw::update() {
+    // the accumulator is added to every other step
+    // and cleared after 7 additions
+    if (_tick & 1) {
+        _accumulator += _volume & 0x3f;
+    }
+
+    if (++_tick == 14) {
+        _tick = 0;
+        _accumulator = 0;
+    }
+
+    _output = _accumulator >> 3;
+}
+
+// VRC6 channels in the order pulse1, pulse2, saw
+unsigned VRC6::count() {
+    return 3;
+}
+
+Channel *VRC6::channel(unsigned index) {
+    switch (index) {
+        case 0: return &pulse1;
+        case 1: return &pulse2;
+        case 2: return &saw;
+        default: return 0;
+    }
+}
+
+// Render a block of VRC6 output
+void VRC6::render(uint16_t *mix, const uint8_t *cycles, unsigned count) {
+    for (unsigned n = 0; n < count; n++) {
+        pulse1.clock(cycles[n]);
+        pulse2.clock(cycles[n]);
+        saw.clock(cycles[n]);
+
+        mix[n] += pulse1.output() + pulse2.output() + saw.output();
+    }
+}
+
+
+// N163 voices
+void N163::Voice::wave(const uint8_t *packed, uint8_t size) {
+    if (size > N163_WAVE_SIZE) {
+        size = N163_WAVE_SIZE;
+    }
+
+    record(LOG_WAVE, size, packed);
+
+    for (unsigned i = 0; i < size; i++) {
+        _wave[i] = (i & 1) ? packed[i/2] >> 4 : packed[i/2] & 0xf;
+    }
+
+    _size = size;
+
+    if (_tick >= _size) {
+        _tick = 0;
+    }
+}
+
+uint16_t N163::Voice::to_period(uint8_t note) {
+    return Periods::wave(note, _size);
+}
+
+// Wave samples are scaled by the volume in 256ths
+void N163::Voice::volume(uint8_t volume) {
+    Channel::volume(volume);
+    _level = ((volume & 0xf) << 8) / 15;
+}
+
+void N163::Voice::update() {
+    if (!_size) return;
+
+    _output = (_wave[_tick] * _level) >> 8;
+
+    if (++_tick >= _size) {
+        _tick = 0;
+    }
+}
+
+// Advance by a number of cycles in one step, the same as clocking
+// an update on every timer edge but without a loop over the edges
+void N163::Voice::advance(unsigned cycles) {
+    if (!_period) return;
+
+    _timer -= cycles;
+    if (_timer > 0) return;
+
+    int period = _period + _pitch;
+    if (period <= 0) period = 1;
+
+    unsigned edges = -_timer / period + 1;
+    _timer += edges * period;
+
+    if (!_size) return;
+
+    // the output holds the sample of the last edge
+    unsigned tick = (_tick + edges - 1) % _size;
+    _output = (_wave[tick] * _level) >> 8;
+    _tick = tick+1 < _size ? tick+1 : 0;
+}
+
+
+// N163 lifetime
+N163::N163()
+  : _count(0)
+  , _turn(0)
+  , _scale(0)
+  , _sum(0)
+  , _cycles(0) {
+}
+
+// Set the number of voices in use
+void N163::enable(unsigned count) {
+    _count = count < N163_VOICES ? count : N163_VOICES;
+    _turn = 0;
+    _scale = _count ? 0x100 / _count : 0;
+    _sum = 0;
+
+    for (unsigned i = 0; i < N163_VOICES; i++) {
+        voices[i]._mark = _cycles;
+
+        if (i < _count) {
+            _sum += voices[i]._output;
+        }
+    }
+}
+
+// Every voice has a channel, whether in use or not
+unsigned N163::count() {
+    return N163_VOICES;
+}
+
+Channel *N163::channel(unsigned index) {
+    return index < N163_VOICES ? &voices[index] : 0;
+}
+
+// Render a block of N163 output, each voice catches up on the
+// cycles since its last turn and the sum of the voice outputs
+// is kept up to date as they change
+void N163::render(uint16_t *mix, const uint8_t *cycles, unsigned count) {
+    if (!_count) return;
+
+    for (unsigned n = 0; n < count; n++) {
+        _cycles += cycles[n];
+
+        Voice &voice = voices[_turn];
+        if (++_turn >= _count) {
+            _turn = 0;
+        }
+
+        _sum -= voice._output;
+        voice.advance(_cycles - voice._mark);
+        voice._mark = _cycles;
+        _sum += voice._output;
+
+        mix[n] += (_sum * _scale) >> 8;
+    }
+}
+
@@ -0,0 +1,305 @@
+
+// Channel Control Log
+//
+
+#include "apu/log.h"
+
+using namespace apu;
+
+
+// Log lifetime
+Log::Log(uint8_t *buffer, unsigned size)
+  : _buffer(buffer)
+  , _size(size) {
+    reset();
+}
+
+// Clear any recorded commands
+void Log::reset() {
+    _off = 0;
+    _wait = 0;
+    _overflow = false;
+
+    for (unsigned i = 0; i < LOG_CHANNELS; i++) {
+        _periods[i] = 0;
+    }
+}
+
+
+// Buffer management
+void Log::emit(uint8_t byte) {
+    if (_off >= _size) {
+        _overflow = true;
+        return;
+    }
+
+    _buffer[_off++] = byte;
+}
+
+void Log::flush() {
+    while (_wait > 0xff) {
+        emit(LOG_WAIT);
+        emit(0xff);
+        _wait -= 0xff;
+    }
+
+    if (_wait > 0xf) {
+        emit(LOG_WAIT);
+        emit(_wait);
+    } else if (_wait) {
+        emit(LOG_WAIT | _wait);
+    }
+
+    _wait = 0;
+}
+
+
+// Record a channel control call
+void Log::write(uint8_t cmd, uint8_t channel, uint16_t arg,
+        const uint8_t *data) {
+    if (channel >= LOG_CHANNELS) return;
+    flush();
+
+    switch (cmd) {
+        case LOG_ENABLE:
+            _periods[channel] = 0xfff;
+            emit(cmd | channel);
+            break;
+
+        case LOG_DISABLE:
+            _periods[channel] = 0;
+            emit(cmd | channel);
+            break;
+
+        case LOG_NOTE:
+            // period depends on the channel's note mapping
+            _periods[channel] = 0;
+            emit(cmd | channel);
+            emit(arg);
+            break;
+
+        case LOG_ADJUST: {
+            int delta = (int)arg - (int)_periods[channel];
+            bool near = _periods[channel] && delta >= -128 && delta <= 127;
+
+            _periods[channel] = arg;
+
+            if (near) {
+                emit(LOG_NUDGE | channel);
+                emit(delta);
+                break;
+            }
+
+            emit(cmd | channel);
+            emit(arg);
+            emit(arg >> 8);
+            break;
+        }
+
+        case LOG_PERIOD:
+            _periods[channel] = arg;
+            emit(cmd | channel);
+            emit(arg);
+            emit(arg >> 8);
+            break;
+
+        case LOG_PITCH:
+            if ((int16_t)arg >= -128 && (int16_t)arg <= 127) {
+                emit(LOG_FINE | channel);
+                emit(arg);
+                break;
+            }
+
+            emit(cmd | channel);
+            emit(arg);
+            emit(arg >> 8);
+            break;
+
+        case LOG_VOLUME:
+        case LOG_DUTY:
+        case LOG_ENVELOPE:
+        case LOG_LENGTH:
+        case LOG_SWEEP:
+            emit(cmd | channel);
+            emit(arg);
+            break;
+
+        case LOG_WAVE:
+            emit(cmd | channel);
+            emit(arg);
+
+            for (unsigned i = 0; i < (arg+1u)/2; i++) {
+                emit(data[i]);
+            }
+            break;
+    }
+}
+
+// Advance the log by one tick
+void Log::tick() {
+    _wait++;
+}
+
+// Terminate the log, returns the recorded size
+unsigned Log::end() {
+    flush();
+    emit(LOG_WAIT);
+    emit(0);
+    return _off;
+}
+
+// Size of the recorded log
+unsigned Log::size() {
+    return _off;
+}
+
+// Check if the log ran out of space
+bool Log::overflow() {
+    return _overflow;
+}
+
+
+// Replay lifetime
+Replay::Replay(APU *apu)
+  : _cmds(0)
+  , _wait(0)
+  , _running(false)
+  , _apu(apu) {
+}
+
+// Loads a recorded log
+void Replay::load(const uint8_t *log) {
+    _cmds = log;
+    _wait = 0;
+
+    for (unsigned i = 0; i < LOG_CHANNELS; i++) {
+        _periods[i] = 0;
+    }
+}
+
+// Step the frame sequencer, the log advances at the end of each frame
+void Replay::step() {
+    if (_apu->step()) {
+        advance();
+    }
+}
+
+// Run the log for one frame
+void Replay::advance() {
+    if (_wait) {
+        _wait--;
+        return;
+    }
+
+    while (true) {
+        uint8_t cmd = *_cmds++;
+        uint8_t ch = cmd & 0xf;
+
+        switch (cmd & 0xf0) {
+            case LOG_WAIT:
+                if (ch) {
+                    _wait = ch - 1;
+                    return;
+                }
+
+                _wait = *_cmds++;
+                if (!_wait) {
+                    stop();
+                    return;
+                }
+
+                _wait -= 1;
+                return;
+
+            case LOG_ENABLE:
+                _periods[ch] = 0xfff;
+                _apu->enable(ch);
+                break;
+
+            case LOG_DISABLE:
+                _periods[ch] = 0;
+                _apu->disable(ch);
+                break;
+
+            case LOG_NOTE:
+                _periods[ch] = 0;
+                _apu->note(ch, *_cmds++);
+                break;
+
+            case LOG_PERIOD:
+                _periods[ch] = _cmds[0] | (_cmds[1] << 8);
+                _cmds += 2;
+                _apu->period(ch, _periods[ch]);
+                break;
+
+            case LOG_ADJUST:
+                _periods[ch] = _cmds[0] | (_cmds[1] << 8);
+                _cmds += 2;
+                _apu->adjust(ch, _periods[ch]);
+                break;
+
+            case LOG_NUDGE:
+                _periods[ch] += (int8_t)*_cmds++;
+                _apu->adjust(ch, _periods[ch]);
+                break;
+
+            case LOG_VOLUME:
+                _apu->volume(ch, *_cmds++);
+                break;
+
+            case LOG_PITCH:
+                _apu->pitch(ch, (int16_t)(_cmds[0] | (_cmds[1] << 8)));
+                _cmds += 2;
+                break;
+
+            case LOG_FINE:
+                _apu->pitch(ch, (int8_t)*_cmds++);
+                break;
+
+            case LOG_DUTY:
+                _apu->duty(ch, *_cmds++);
+                break;
+
+            case LOG_ENVELOPE:
+                _apu->envelope(ch, *_cmds & 0xf, *_cmds & 0x10);
+                _cmds++;
+                break;
+
+            case LOG_LENGTH:
+                _apu->length(ch, *_cmds++);
+                break;
+
+            case LOG_SWEEP:
+                _apu->sweep(ch, *_cmds++);
+                break;
+
+            case LOG_WAVE:
+                _apu->wave(ch, _cmds + 1, _cmds[0]);
+                _cmds += 1 + (_cmds[0]+1)/2;
+                break;
+
+            default:
+                stop();
+                return;
+        }
+    }
+}
+
+// Starting/stopping the replay
+void Replay::start() {
+    _running = true;
+
+    // a bus drives the replay from its own timer
+    if (!_apu->_bus) {
+        _ticker.attach_us(this, &Replay::step, 1000000/APU_SEQUENCER_FREQ);
+    }
+}
+
+void Replay::stop() {
+    _running = false;
+    _ticker.detach();
+
+    for (unsigned i = 0; i < LOG_CHANNELS; i++) {
+        _apu->disable(i);
+    }
+}
@@ -0,0 +1,294 @@
+
+// Render Cache
+//
+
+#include "apu/memo.h"
+#include <string.h>
+
+using namespace apu;
+
+
+// Link for the end of a page chain
+#define NONE 0xffff
+
+
+// Memo lifetime
+Memo::Memo(uint8_t *buffer, unsigned size)
+  : _buffer(buffer)
+  , _pages(size/MEMO_PAGE_SIZE < MEMO_PAGES
+            ? size/MEMO_PAGE_SIZE : MEMO_PAGES)
+  , _epoch(0) {
+    flush();
+}
+
+// Drop all cached frames
+void Memo::flush() {
+    for (unsigned i = 0; i < _pages; i++) {
+        _links[i] = i+1 < _pages ? i+1 : NONE;
+    }
+
+    _free = _pages ? 0 : NONE;
+
+    for (unsigned i = 0; i < MEMO_ENTRIES; i++) {
+        _entries[i].size = 0;
+        _entries[i].ticks = 0;
+        _entries[i].page = NONE;
+        _entries[i].age = 0;
+    }
+
+    _clock = 0;
+    _entry = 0;
+    _pos = 0;
+    _page = NONE;
+    _remaining = 0;
+    memset(_last, 0, sizeof _last);
+    _playing = false;
+    _hits = 0;
+    _misses = 0;
+}
+
+
+// Find a cached frame, skipping the one being recorded
+Memo::Entry *Memo::find(uint8_t frame, uint32_t key) {
+    for (unsigned i = 0; i < MEMO_ENTRIES; i++) {
+        Entry *entry = &_entries[i];
+
+        if (entry->ticks && entry != _entry &&
+            entry->frame == frame && entry->key == key) {
+            return entry;
+        }
+    }
+
+    return 0;
+}
+
+// Find the least recently used frame, skipping the one being recorded
+Memo::Entry *Memo::oldest() {
+    Entry *oldest = 0;
+
+    for (unsigned i = 0; i < MEMO_ENTRIES; i++) {
+        Entry *entry = &_entries[i];
+
+        if (entry->ticks && entry != _entry &&
+            (!oldest || entry->age < oldest->age)) {
+            oldest = entry;
+        }
+    }
+
+    return oldest;
+}
+
+// Mark a frame as recently used
+void Memo::touch(Entry *entry) {
+    // Restart the ages if the clock wraps
+    if (++_clock == 0) {
+        for (unsigned i = 0; i < MEMO_ENTRIES; i++) {
+            _entries[i].age = 0;
+        }
+
+        _clock = 1;
+    }
+
+    entry->age = _clock;
+}
+
+// Return the pages of a frame to the free list
+void Memo::release(Entry *entry) {
+    uint16_t page = entry->page;
+
+    while (page != NONE) {
+        uint16_t next = _links[page];
+        _links[page] = _free;
+        _free = page;
+        page = next;
+    }
+
+    entry->size = 0;
+    entry->ticks = 0;
+    entry->page = NONE;
+}
+
+
+// Step the sequencer, or skip it while a cached frame plays back
+void Memo::tick(NSF *nsf) {
+    // Drop the current frame if the song was restarted
+    if (nsf->_epoch != _epoch) {
+        if (_entry && !_playing) {
+            release(_entry);
+        }
+
+        _epoch = nsf->_epoch;
+        _entry = 0;
+        _playing = false;
+    }
+
+    if (_playing) {
+        if (_remaining) {
+            _remaining--;
+            return;
+        }
+
+        nsf->restore(_entry->exit);
+        _entry = 0;
+        _playing = false;
+    }
+
+    // Expansion chips are rendered outside of the cached samples
+    if (nsf->entering() && !nsf->_deferred && !nsf->_song.expansion) {
+        uint8_t frame = nsf->_frame;
+        uint32_t key = nsf->key();
+
+        // Finish the frame being recorded
+        if (_entry) {
+            _entry->size = _pos;
+            nsf->save(_entry->exit);
+            _entry = 0;
+        }
+
+        Entry *entry = find(frame, key);
+
+        if (entry) {
+            _hits++;
+            touch(entry);
+
+            _entry = entry;
+            _pos = 0;
+            _page = entry->page;
+            _remaining = entry->ticks - 1;
+            memset(_last, 0, sizeof _last);
+            _playing = true;
+            return;
+        }
+
+        // Start recording into an unused or the oldest entry
+        _misses++;
+
+        for (unsigned i = 0; i < MEMO_ENTRIES && !entry; i++) {
+            if (!_entries[i].ticks) {
+                entry = &_entries[i];
+            }
+        }
+
+        if (!entry) {
+            entry = oldest();
+            release(entry);
+        }
+
+        entry->key = key;
+        entry->frame = frame;
+        touch(entry);
+
+        _entry = entry;
+        _pos = 0;
+        _page = NONE;
+    }
+
+    nsf->tick();
+
+    // Frames that stop or change the song are not cached
+    if (_entry) {
+        if (!nsf->_running || nsf->_epoch != _epoch) {
+            release(_entry);
+            _entry = 0;
+        } else {
+            _entry->ticks++;
+        }
+    }
+}
+
+// Next channel outputs of the frame being played back, the
+// last sample is repeated if the frame runs a sample longer
+void Memo::read(uint8_t *outputs) {
+    if (_pos < _entry->size) {
+        for (unsigned i = 0; i < NSF_APU_CHANNELS; i++) {
+            _last[i] = get();
+        }
+
+        uint8_t playing = get();
+
+        for (unsigned i = 0; i < NSF_APU_CHANNELS; i++) {
+            if (playing & (1 << i)) {
+                _last[i] |= MEMO_PLAYING;
+            }
+        }
+    }
+
+    memcpy(outputs, _last, NSF_APU_CHANNELS);
+}
+
+// Add the channel outputs of a sample to the frame being recorded
+void Memo::write(const uint8_t *outputs) {
+    uint8_t playing = 0;
+
+    for (unsigned i = 0; i < NSF_APU_CHANNELS; i++) {
+        put(outputs[i] & 0xf);
+
+        if (outputs[i] & MEMO_PLAYING) {
+            playing |= 1 << i;
+        }
+    }
+
+    put(playing);
+}
+
+// Nibbles are packed two to a byte, low nibble first
+uint8_t Memo::get() {
+    if (_pos % (2*MEMO_PAGE_SIZE) == 0 && _pos) {
+        _page = _links[_page];
+    }
+
+    uint8_t byte = _buffer[_page*MEMO_PAGE_SIZE + (_pos/2) % MEMO_PAGE_SIZE];
+    return (_pos++ & 1) ? byte >> 4 : byte & 0xf;
+}
+
+void Memo::put(uint8_t nibble) {
+    if (!_entry) return;
+
+    if (_pos % (2*MEMO_PAGE_SIZE) == 0) {
+        // Make room by dropping older frames, giving up
+        // on the frame if it does not fit on its own
+        while (_free == NONE) {
+            Entry *entry = oldest();
+
+            if (!entry) {
+                release(_entry);
+                _entry = 0;
+                return;
+            }
+
+            release(entry);
+        }
+
+        uint16_t page = _free;
+        _free = _links[page];
+        _links[page] = NONE;
+
+        if (_page == NONE) {
+            _entry->page = page;
+        } else {
+            _links[_page] = page;
+        }
+
+        _page = page;
+    }
+
+    uint8_t *byte = &_buffer[_page*MEMO_PAGE_SIZE + (_pos/2) % MEMO_PAGE_SIZE];
+
+    if (_pos & 1) {
+        *byte |= nibble << 4;
+    } else {
+        *byte = nibble;
+    }
+
+    _pos++;
+}
+
+
+// Number of frames copied from and added to the cache
+unsigned Memo::hits() {
+    return _hits;
+}
+
+unsigned Memo::misses() {
+    return _misses;
+}
@@ -3,75 +3,335 @@
 //
 
 #include "apu/nsf.h"
+#include "apu/tables.h"
+#include "apu/periods.h"
+#include "apu/digest.h"
+#include <stdlib.h>
+#include <string.h>
 
 using namespace apu;
 
 
-// Sequence and Channel names
-#define SQUARE1  0
-#define SQUARE2  1
-#define TRIANGLE 2
-#define NOISE    3
-#define DCPM     4
+// Frame slot of channels not used by the song
+#define SLOT_NONE 0xff
 
-#define VOLUME   0
-#define ARPEGGIO 1
-#define PITCH    2
-#define HIPITCH  3
-#define DUTY     4
+// LFO names
+#define VIBRATO  0
+#define TREMOLO  1
 
+// Channel volume is kept in eighths for volume slides
+#define VOLUME_MAX (0xf << 3)
+
+// Snapshot flags
+#define STATE_ENABLE  0x01
+#define STATE_DISABLE 0x02
+#define STATE_PERIOD  0x04
+#define STATE_ADJUST  0x08
+#define STATE_VOLUME  0x10
+#define STATE_PITCH   0x20
+#define STATE_DUTY    0x40
+#define STATE_SWEEP   0x80
+#define STATE_WAVE    0x100
+
+// Handoff flags
+#define HANDOFF_GAIN   0x01
+#define HANDOFF_EXPAND 0x02
+#define HANDOFF_STOP   0x04
+
+
+// Sine quarter wave for a given LFO depth, 16 depths by 16 phases
+constexpr double sine(double x) {
+    return x - x*x*x/6 + x*x*x*x*x/120 - x*x*x*x*x*x*x/5040
+             + x*x*x*x*x*x*x*x*x/362880;
+}
+
+constexpr int8_t LFO_DEPTHS[16] = {
+    0, 1, 2, 3, 4, 6, 8, 11, 15, 20, 27, 36, 48, 64, 90, 127
+};
+
+struct Lfo {
+    static constexpr int8_t entry(unsigned n) {
+        return (int8_t)(LFO_DEPTHS[n >> 4]
+            * sine((n & 0xf) * 3.14159265358979 / 32) + 0.5);
+    }
+};
+
+// LFO lookup table
+const static int8_t *LFO = Table<Lfo, 256>::table;
+
+
+// Song data access
+inline uint8_t NSF::Song::read(uint16_t addr) const {
+    if (data) {
+        return data[addr];
+    } else {
+        return cache->read(addr);
+    }
+}
 
 // Offset calculation for 16-bit NES address lookups
-inline uint8_t *NSF::lookup(uint8_t *addr, unsigned off) {
-    return &_data[addr[2*off] | (addr[2*off + 1] << 8)];
+inline uint16_t NSF::Song::lookup(uint16_t addr, unsigned off) const {
+    return read(addr + 2*off) | (read(addr + 2*off + 1) << 8);
+}
+
+inline uint8_t NSF::read(uint16_t addr) {
+    return _song.read(addr);
+}
+
+inline uint16_t NSF::lookup(uint16_t addr, unsigned off) {
+    return _song.lookup(addr, off);
+}
+
+
+// Control lifetime
+NSF::Control::Control(apu::Channel *channel)
+  : channel(channel)
+  , deferred(false)
+  , voice(false) {
+    if (channel) {
+        sync();
+    }
+}
+
+// Channel control
+void NSF::Control::enable() {
+    if (!deferred) {
+        channel->enable();
+        return;
+    }
+
+    state.period = 0xfff;
+    state.flags &= ~(STATE_DISABLE | STATE_PERIOD | STATE_ADJUST);
+    state.flags |= STATE_ENABLE;
+}
+
+void NSF::Control::disable() {
+    if (!deferred) {
+        channel->disable();
+        return;
+    }
+
+    state.period = 0;
+    state.flags &= ~(STATE_ENABLE | STATE_PERIOD | STATE_ADJUST);
+    state.flags |= STATE_DISABLE;
+}
+
+void NSF::Control::note(uint8_t note) {
+    if (!deferred) {
+        channel->note(note);
+        return;
+    }
+
+    uint16_t period = to_period(note);
+    if (period > 0xfff || period <= 8) {
+        disable();
+        return;
+    }
+
+    state.period = period;
+    state.flags &= ~STATE_ADJUST;
+    state.flags |= STATE_PERIOD;
+}
+
+void NSF::Control::adjust_period(uint16_t period) {
+    if (!deferred) {
+        channel->adjust_period(period);
+        return;
+    }
+
+    // a stopped channel stays stopped until it is enabled
+    if (!state.period) return;
+
+    if (period > 0xfff || period <= 8) {
+        disable();
+        return;
+    }
+
+    state.period = period;
+    if (!(state.flags & STATE_PERIOD)) {
+        state.flags |= STATE_ADJUST;
+    }
+}
+
+uint16_t NSF::Control::get_period() {
+    if (!deferred) {
+        return channel->get_period();
+    }
+
+    return state.period;
+}
+
+uint16_t NSF::Control::to_period(uint8_t note) {
+#if NSF_N163
+    // voice periods follow the wave waiting to be applied
+    if (deferred && voice) {
+        return Periods::wave(note, state.wave_size);
+    }
+#endif
+
+    return channel->to_period(note);
+}
+
+void NSF::Control::volume(uint8_t volume) {
+    if (!deferred) {
+        channel->volume(volume);
+        return;
+    }
+
+    state.volume = volume;
+    state.flags |= STATE_VOLUME;
+}
+
+void NSF::Control::pitch(int16_t offset) {
+    if (!deferred) {
+        channel->pitch(offset);
+        return;
+    }
+
+    state.pitch = offset;
+    state.flags |= STATE_PITCH;
+}
+
+void NSF::Control::duty(uint8_t duty) {
+    if (!deferred) {
+        channel->duty(duty);
+        return;
+    }
+
+    state.duty = duty;
+    state.flags |= STATE_DUTY;
+}
+
+void NSF::Control::sweep(uint8_t sweep) {
+    if (!deferred) {
+        channel->sweep(sweep);
+        return;
+    }
+
+    state.sweep = sweep;
+    state.flags |= STATE_SWEEP;
+}
+
+#if NSF_N163
+void NSF::Control::wave(const uint8_t *packed, uint8_t size) {
+    if (!deferred) {
+        channel->wave(packed, size);
+        return;
+    }
+
+    memcpy(state.wave, packed, (size+1)/2);
+    state.wave_size = size;
+    state.flags |= STATE_WAVE;
+    voice = true;
+}
+#endif
+
+// Synchronize the snapshot state with the synthesizer
+void NSF::Control::sync() {
+    state.period = channel->get_period();
+    state.pitch = 0;
+    state.volume = 0xf;
+    state.duty = 0;
+    state.sweep = 0;
+    state.flags = 0;
+    voice = false;
+}
+
+// Apply a snapshot to the synthesizer
+void NSF::Control::apply(const State &state) {
+    if (state.flags & STATE_DISABLE) {
+        channel->disable();
+    }
+
+    if (state.flags & STATE_ENABLE) {
+        channel->enable();
+    }
+
+    if (state.flags & STATE_PITCH) {
+        channel->pitch(state.pitch);
+    }
+
+#if NSF_N163
+    if (state.flags & STATE_WAVE) {
+        channel->wave(state.wave, state.wave_size);
+    }
+#endif
+
+    if (state.flags & STATE_PERIOD) {
+        channel->set_period(state.period);
+    } else if (state.flags & STATE_ADJUST) {
+        channel->adjust_period(state.period);
+    }
+
+    if (state.flags & STATE_VOLUME) {
+        channel->volume(state.volume);
+    }
+
+    if (state.flags & STATE_DUTY) {
+        channel->duty(state.duty);
+    }
+
+    if (state.flags & STATE_SWEEP) {
+        channel->sweep(state.sweep);
+    }
 }
 
 
 // Channel lifetime
 NSF::Channel::Channel(apu::Channel *channel)
-  : _channel(channel) {
+  : _out(channel)
+  , _nsf(0)
+  , _slot(SLOT_NONE)
+  , _n163(false) {
     reset();
 }
 
 // Reset channel
 void NSF::Channel::reset(void) {
     // Hacky, but sometimes the simpliest solutions are the best ones
-    memset(&_cmds, 0, (uint8_t *)&_channel - (uint8_t *)&_cmds);
+    memset(&_cmds, 0, (uint8_t *)&_out - (uint8_t *)&_cmds);
 
-    _volume = 0xf;
+    _volume = VOLUME_MAX;
+    _envelope = 0xf;
 }
 
 // Enable/disable channel
 void NSF::Channel::enable(void) {
     _enabled = true;
-    _channel->enable();
+    _out.enable();
 }
 
 void NSF::Channel::disable(void) {
     _enabled = false;
-    _channel->disable();
+    _out.disable();
 }
 
 
 // Loads channel setup
-void NSF::Channel::frame(uint8_t *frame) {
+void NSF::Channel::frame(uint16_t frame) {
+    // Finish a row held by a delay before leaving the pattern
+    if (_hold) {
+        _hold = 0;
+        run();
+    }
+
     _cmds = frame;
     _delay = 0;
     _pdelay = 0xff;
 }
 
-void NSF::Channel::sequence(uint8_t *inst) {
-    uint8_t mask = *inst++;
+void NSF::Channel::sequence(uint16_t inst) {
+    uint8_t mask = _nsf->read(inst++);
 
     for (unsigned i = 0; i < NSF_SEQUENCES; i++) {
         if (mask & (1 << i)) {
-            uint8_t *seq = _nsf->lookup(inst, 0);
+            uint16_t seq = _nsf->lookup(inst, 0);
             inst += 2;
 
-            _seq[i].count = seq[0];
-            _seq[i].data = &seq[4];
+            _seq[i].count = _nsf->read(seq);
+            _seq[i].data = seq + 4;
             _seq[i].tick = 0;
-            _seq[i].repeat = seq[1];
+            _seq[i].repeat = _nsf->read(seq + 1);
         } else {
             _seq[i].count = 0;
             _seq[i].data = 0;
@@ -80,41 +340,78 @@ void NSF::Channel::sequence(uint8_t *inst) {
         }
     }
 
-    _channel->pitch(0);
-    _channel->duty(0);
+#if NSF_N163
+    // N163 instruments follow the sequences with the wave size in
+    // samples, the wave position and the address of the wave, which
+    // is packed two samples to a byte low nibble first
+    if (_n163) {
+        uint8_t size = _nsf->read(inst);
+        uint16_t wave = _nsf->lookup(inst + 2, 0);
+        uint8_t packed[N163_WAVE_SIZE/2];
+
+        if (size > N163_WAVE_SIZE) {
+            size = N163_WAVE_SIZE;
+        }
+
+        for (unsigned i = 0; i < (size+1u)/2; i++) {
+            packed[i] = _nsf->read(wave + i);
+        }
+
+        _out.wave(packed, size);
+    }
+#endif
+
+    if (!_seq[NSF_SEQ_VOLUME].count) {
+        _envelope = 0xf;
+    }
+
+    _pitch = 0;
+    _out.duty(0);
 }
 
 
 // Channel updates
 void NSF::Channel::exec() {
+    // Finish a row held by a delay
+    if (_hold) {
+        _hold = 0;
+        run();
+    }
+
     // Check delay
     if (_delay) {
         _delay--;
         return;
     }
 
-    // Execute commands
+    run();
+}
+
+// Execute commands up to the end of the row or a delay
+void NSF::Channel::run() {
     uint8_t cmd;
 
     do {
-        cmd = *_cmds++;
+        cmd = _nsf->read(_cmds++);
 
         if ((cmd & 0x80) == 0x00) { // notes
             if (cmd == 0x00) {
                 // pass
             } else if (cmd == 0x7f) {
-                _channel->disable();
+                _out.disable();
                 _enabled = false;
             } else {
                 _note = cmd-1;
 
                 if (!_enabled) {
-                    _channel->enable();
+                    _out.enable();
                 }
 
                 if (!_port || !_enabled) {
-                    _channel->pitch(0);
-                    _channel->note(_note);
+                    _pitch = 0;
+                    _mod_pitch = 0;
+                    _out.pitch(0);
+                    _out.note(_note);
                 }
 
                 for (unsigned i = 0; i < NSF_SEQUENCES; i++) {
@@ -124,11 +421,11 @@ void NSF::Channel::exec() {
                 _enabled = true;
             }
         } else if (cmd < 0xb0) { // other commands
-            uint8_t arg = *_cmds++;
+            uint8_t arg = _nsf->read(_cmds++);
 
             switch (cmd) {
                 case 0x80: // change instrument
-                    sequence(_nsf->lookup(_nsf->_insts, arg));
+                    sequence(_nsf->lookup(_nsf->_song.insts, arg));
                     break;
 
                 case 0x82: // change speed
@@ -137,22 +434,26 @@ void NSF::Channel::exec() {
                     break;
 
                 case 0x84: // jump to frame
-                    _nsf->_pattern = _nsf->_pattern_count;
+                    if (arg < _nsf->_frame) {
+                        _nsf->_loop = true;
+                    }
+
+                    _nsf->_pattern = _nsf->_song.pattern_count;
                     _nsf->_frame = arg;
                     _pdelay = 1;
                     break;
 
                 case 0x86: // skip frame
-                    _nsf->_pattern = _nsf->_pattern_count;
+                    _nsf->_pattern = _nsf->_song.pattern_count;
                     _pdelay = 1;
                     break;
 
                 case 0x88: // halt
-                    _nsf->stop();
+                    _nsf->_halt = true;
                     break;
 
                 case 0x8a: // set volume
-                    _channel->volume(arg);
+                    _volume = (arg & 0xf) << 3;
                     break;
 
                 case 0x8c: // set portamento
@@ -170,16 +471,15 @@ void NSF::Channel::exec() {
                     _slide_target = 0x7ff;
                     break;
 
-                case 0x92: // sweep
-                    _sweep = arg & 0x7f;
-                    _sweep_div = (arg & 0x70) >> 4;
+                case 0x92: // sweep, run by the channel's sweep unit
+                    _out.sweep((arg & 0x7f) ? (arg | 0x80) : 0);
 
                     if (!_enabled) {
-                        _channel->enable();
+                        _out.enable();
                         _enabled = true;
                     }
 
-                    _channel->note(_note);
+                    _out.note(_note);
                     break;
 
                 case 0x94: // arpeggio
@@ -187,49 +487,66 @@ void NSF::Channel::exec() {
                     _arp_count = 0;
                     break;
 
+                case 0x96: // vibrato
+                    _lfo[VIBRATO].speed = arg >> 4;
+                    _lfo[VIBRATO].depth = arg & 0xf;
+                    break;
+
+                case 0x98: // tremelo
+                    _lfo[TREMOLO].speed = arg >> 4;
+                    _lfo[TREMOLO].depth = arg & 0xf;
+                    break;
+
                 case 0x9a: // pitch
-                    _channel->pitch(((int16_t)arg) - 0x80);
+                    _pitch = ((int16_t)arg) - 0x80;
+                    break;
+
+                case 0x9c: // delay, the rest of the row runs later
+                    if (arg) {
+                        _hold = arg < 0xff ? arg+1 : 0xff;
+                        return;
+                    }
                     break;
 
                 case 0xa0: // duty
-                    _channel->duty(arg);
+                    _out.duty(arg);
                     break;
 
                 case 0xa4: // slide up
                     _note += arg & 0xf;
                     _slide = 2*(arg >> 4) + 1;
-                    _slide_target = _channel->to_period(_note);
+                    _slide_target = _out.to_period(_note);
                     break;
 
                 case 0xa6: // slide down
                     _note -= arg & 0xf;
                     _slide = 2*(arg >> 4) + 1;
-                    _slide_target = _channel->to_period(_note);
+                    _slide_target = _out.to_period(_note);
+                    break;
+
+                case 0xa8: // volume slide, in eighths per tick
+                    _volume_slide = (arg >> 4) - (arg & 0xf);
                     break;
 
                 case 0xaa: // note cut
                     _cut = arg;
                     break;
 
-                case 0x96: // vibrato
-                case 0x98: // tremelo
-                case 0x9c: // delay
                 case 0x9e: // dac
-                case 0xa2: // offset
-                case 0xa8: // volume slide
-                case 0xac: // retrigger
+                case 0xa2: // offset, only applies to the dpcm channel
+                case 0xac: // dpcm retrigger
                 case 0xae: // dpcm pitch
                 default:
                     break;
             }
         } else if ((cmd & 0xf0) == 0xe0) { // change instrument
-            sequence(_nsf->lookup(_nsf->_insts, cmd & 0xf));
+            sequence(_nsf->lookup(_nsf->_song.insts, cmd & 0xf));
 
         } else if ((cmd & 0xf0) == 0xf0) { // volume change
-            _channel->volume(cmd & 0xf);
+            _volume = (cmd & 0xf) << 3;
 
         } else if (cmd == 0xb0) { // set delay
-            _pdelay = *_cmds++;
+            _pdelay = _nsf->read(_cmds++);
 
         } else if (cmd == 0xb2) { // reset delay
             _pdelay = 0xff;
@@ -239,7 +556,7 @@ void NSF::Channel::exec() {
 
     // Delay some amount
     if (_pdelay == 0xff) {
-        _delay = *_cmds++;
+        _delay = _nsf->read(_cmds++);
     } else {
         _delay = _pdelay;
     }
@@ -247,46 +564,30 @@ void NSF::Channel::exec() {
 
 // Step NSF engine
 void NSF::Channel::tick() {
-    if (_cut && !(--_cut)) {
-        _channel->disable();
-        _enabled = false;
+    if (_hold && !(--_hold)) {
+        run();
     }
 
-    if (_sweep && !(--_sweep_div)) {
-        uint16_t target = _channel->get_period();
-
-        if (_sweep & 0x8) {
-            target -= target >> (_sweep & 0x7);
-        } else {
-            target += target >> (_sweep & 0x7);
-        }
-
-        if (target > 0x7ff || target < 8) {
-            _channel->disable();
-            _enabled = false;
-            _sweep = 0;
-        } else {
-            _channel->adjust_period(target);
-        }
-
-        _sweep_div = (_sweep & 0x70) >> 4;
+    if (_cut && !(--_cut)) {
+        _out.disable();
+        _enabled = false;
     }
 
     if (_arpeggio) {
         if (_arp_count == 0) {
-            _channel->note(_note);
+            _out.note(_note);
             _arp_count = 1;
         } else if (_arp_count == 1 && _arpeggio & 0xf0) {
-            _channel->note(_note + (_arpeggio >> 4));
+            _out.note(_note + (_arpeggio >> 4));
             _arp_count = 2;
         } else {
-            _channel->note(_note + (_arpeggio & 0xf));
+            _out.note(_note + (_arpeggio & 0xf));
             _arp_count = 0;
         }
     }
 
     if (_slide) {
-        uint16_t period = _channel->get_period();
+        uint16_t period = _out.get_period();
 
         if (period > _slide_target) {
             period -= _slide;
@@ -294,18 +595,18 @@ void NSF::Channel::tick() {
                 _slide = 0;
             }
 
-            _channel->adjust_period(period);
+            _out.adjust_period(period);
         } else {
             period += _slide;
             if (period >= _slide_target) {
                 _slide = 0;
             }
 
-            _channel->adjust_period(period);
+            _out.adjust_period(period);
         }
     } else if (_port) {
-        uint16_t period = _channel->get_period();
-        uint16_t target = _channel->to_period(_note);
+        uint16_t period = _out.get_period();
+        uint16_t target = _out.to_period(_note);
 
         if (period > target) {
             period -= _port;
@@ -313,140 +614,723 @@ void NSF::Channel::tick() {
                 period = target;
             }
 
-            _channel->adjust_period(period);
+            _out.adjust_period(period);
         } else if (period > target) {
             period += _port;
             if (period >= target) {
                 period = target;
             }
 
-            _channel->adjust_period(period);
+            _out.adjust_period(period);
         }
     }
 
     if (_enabled) {
-        if (_seq[VOLUME].tick < _seq[VOLUME].count) {
-            _channel->volume(_volume * _seq[VOLUME].data[_seq[VOLUME].tick++] / 0xf);
-        } else if (_seq[VOLUME].repeat != 0xff) {
-            _seq[VOLUME].tick = _seq[VOLUME].repeat;
+        if (_seq[NSF_SEQ_VOLUME].tick < _seq[NSF_SEQ_VOLUME].count) {
+            _envelope = _nsf->read(_seq[NSF_SEQ_VOLUME].data
+                    + _seq[NSF_SEQ_VOLUME].tick++);
+        } else if (_seq[NSF_SEQ_VOLUME].repeat != 0xff) {
+            _seq[NSF_SEQ_VOLUME].tick = _seq[NSF_SEQ_VOLUME].repeat;
         }
 
-        if (_seq[ARPEGGIO].tick < _seq[ARPEGGIO].count) {
-            _channel->note(_note + _seq[ARPEGGIO].data[_seq[ARPEGGIO].tick++]);
-        } else if (_seq[ARPEGGIO].repeat != 0xff) {
-            _seq[ARPEGGIO].tick = _seq[ARPEGGIO].repeat;
+        if (_seq[NSF_SEQ_ARPEGGIO].tick < _seq[NSF_SEQ_ARPEGGIO].count) {
+            _out.note(_note + _nsf->read(_seq[NSF_SEQ_ARPEGGIO].data
+                    + _seq[NSF_SEQ_ARPEGGIO].tick++));
+        } else if (_seq[NSF_SEQ_ARPEGGIO].repeat != 0xff) {
+            _seq[NSF_SEQ_ARPEGGIO].tick = _seq[NSF_SEQ_ARPEGGIO].repeat;
         }
 
-        if (_seq[PITCH].tick < _seq[PITCH].count) {
-            _channel->pitch(-_seq[PITCH].data[_seq[PITCH].tick++]);
-        } else if (_seq[PITCH].repeat != 0xff) {
-            _seq[PITCH].tick = _seq[PITCH].repeat;
+        if (_seq[NSF_SEQ_PITCH].tick < _seq[NSF_SEQ_PITCH].count) {
+            _pitch = -_nsf->read(_seq[NSF_SEQ_PITCH].data
+                    + _seq[NSF_SEQ_PITCH].tick++);
+        } else if (_seq[NSF_SEQ_PITCH].repeat != 0xff) {
+            _seq[NSF_SEQ_PITCH].tick = _seq[NSF_SEQ_PITCH].repeat;
         }
 
-        if (_seq[HIPITCH].tick < _seq[HIPITCH].count) {
-            _channel->pitch(-16*_seq[HIPITCH].data[_seq[HIPITCH].tick++]);
-        } else if (_seq[HIPITCH].repeat != 0xff) {
-            _seq[HIPITCH].tick = _seq[HIPITCH].repeat;
+        if (_seq[NSF_SEQ_HIPITCH].tick < _seq[NSF_SEQ_HIPITCH].count) {
+            _pitch = -16*_nsf->read(_seq[NSF_SEQ_HIPITCH].data
+                    + _seq[NSF_SEQ_HIPITCH].tick++);
+        } else if (_seq[NSF_SEQ_HIPITCH].repeat != 0xff) {
+            _seq[NSF_SEQ_HIPITCH].tick = _seq[NSF_SEQ_HIPITCH].repeat;
         }
 
-        if (_seq[DUTY].tick < _seq[DUTY].count) {
-            _channel->duty(_seq[DUTY].data[_seq[DUTY].tick++]);
-        } else if (_seq[DUTY].repeat != 0xff) {
-            _seq[DUTY].tick = _seq[DUTY].repeat;
+        if (_seq[NSF_SEQ_DUTY].tick < _seq[NSF_SEQ_DUTY].count) {
+            _out.duty(_nsf->read(_seq[NSF_SEQ_DUTY].data
+                    + _seq[NSF_SEQ_DUTY].tick++));
+        } else if (_seq[NSF_SEQ_DUTY].repeat != 0xff) {
+            _seq[NSF_SEQ_DUTY].tick = _seq[NSF_SEQ_DUTY].repeat;
         }
     }
+
+    modulate();
+}
+
+// Modulation stage, combines the base pitch and volume set by commands
+// and sequences with the LFOs, LFOs without depth read as zero
+void NSF::Channel::modulate() {
+    int mod[NSF_LFOS];
+
+    for (unsigned i = 0; i < NSF_LFOS; i++) {
+        // Phase runs over 64 ticks, the quarter wave is
+        // mirrored for the second and negated for the last half
+        uint8_t phase = _lfo[i].phase;
+        uint8_t index = (phase ^ -((phase >> 4) & 1)) & 0xf;
+        int sign = -((phase >> 5) & 1);
+
+        mod[i] = (LFO[(_lfo[i].depth << 4) | index] ^ sign) - sign;
+        _lfo[i].phase = (phase + _lfo[i].speed) & 0x3f;
+    }
+
+    int volume = _volume + _volume_slide;
+    _volume = volume < 0 ? 0 : volume > VOLUME_MAX ? VOLUME_MAX : volume;
+
+    volume = (_volume >> 3)*_envelope/0xf - (abs(mod[TREMOLO]) >> 3);
+    volume = volume < 0 ? 0 : volume;
+    int16_t pitch = _pitch + mod[VIBRATO];
+
+    if (volume != _mod_volume) {
+        _mod_volume = volume;
+        _out.volume(volume);
+    }
+
+    if (pitch != _mod_pitch) {
+        _mod_pitch = pitch;
+        _out.pitch(pitch);
+    }
 }
 
 
 // NSF lifetime
 NSF::NSF(PinName pin)
   : _apu{
-        Square(), Square(), Triangle(), Noise(), 
+        Square(), Square(), Triangle(), Noise(),
+#if NSF_VRC6
+        VRC6(),
+#endif
+#if NSF_N163
+        N163(),
+#endif
         {&_apu.square1, &_apu.square2, &_apu.triangle, &_apu.noise},
-        APU(_apu.channels, NSF_CHANNELS, pin)
+        APU(_apu.channels, NSF_APU_CHANNELS, pin)
     }
   , _channels{
         Channel(&_apu.square1),
         Channel(&_apu.square2),
         Channel(&_apu.triangle),
         Channel(&_apu.noise),
-    } {
+    }
+  , _log(0)
+  , _deferred(false)
+  , _stopping(false)
+  , _events(0)
+  , _head(0)
+  , _tail(0)
+  , _post(0)
+  , _post_gain(0x100) {
+
+    // expansion channels follow the APU channels
+#if NSF_VRC6
+    _apu.channels[NSF_APU_CHANNELS+0] = &_apu.vrc6.pulse1;
+    _apu.channels[NSF_APU_CHANNELS+1] = &_apu.vrc6.pulse2;
+    _apu.channels[NSF_APU_CHANNELS+2] = &_apu.vrc6.saw;
+#endif
+#if NSF_N163
+    for (unsigned i = 0; i < N163_VOICES; i++) {
+        _apu.channels[NSF_CHANNELS-N163_VOICES + i] = &_apu.n163.voices[i];
+    }
+#endif
 
     for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        if (i >= NSF_APU_CHANNELS) {
+            _channels[i]._out = Control(_apu.channels[i]);
+        }
+
         _channels[i]._nsf = this;
     }
+
+    _song.data = 0;
+    _song.cache = 0;
+    _running = false;
+    _epoch = 0;
+    _loop_limit = 0;
+    _fade_count = 0;
 }
 
 // Loads a compiled NSF file
-void NSF::load(uint8_t *data, int song) {
-    _data = data;
+void NSF::load(const uint8_t *data, int song,
+        uint8_t expansion, uint8_t voices) {
+    Song next;
+    prepare(next, data, song, expansion, voices);
+    play(next);
+}
+
+// Loads a compiled NSF file from external storage
+void NSF::load(Cache *cache, int song,
+        uint8_t expansion, uint8_t voices) {
+    // streamed songs are only read from the dispatch thread
+    if (!_deferred) {
+        defer();
+    }
+
+    cache->flush();
+
+    Song next;
+    prepare(next, cache, song, expansion, voices);
+    play(next);
+}
+
+// Parse the header of a song
+void NSF::prepare(Song &song, const uint8_t *data, int index,
+        uint8_t expansion, uint8_t voices) {
+    song.data = data;
+    song.cache = 0;
+    song.expansion = expansion;
+    song.voices = voices;
 
     // Get the song info
-    uint8_t *info = lookup(lookup(data, 0), song);
+    uint16_t info = song.lookup(song.lookup(0, 0), index);
+
+    song.frames = song.lookup(info, 0);
+    song.insts = song.lookup(0, 1);
+
+    song.frame_count   = song.read(info + 2);
+    song.pattern_count = song.read(info + 3);
+    song.tick_count    = song.read(info + 4);
+}
+
+void NSF::prepare(Song &song, Cache *cache, int index,
+        uint8_t expansion, uint8_t voices) {
+    song.data = 0;
+    song.cache = cache;
+    song.expansion = expansion;
+    song.voices = voices;
+
+    // Get the song info
+    uint16_t info = song.lookup(song.lookup(0, 0), index);
+
+    song.frames = song.lookup(info, 0);
+    song.insts = song.lookup(0, 1);
+
+    song.frame_count   = song.read(info + 2);
+    song.pattern_count = song.read(info + 3);
+    song.tick_count    = song.read(info + 4);
+
+    // Bring in the frame and instrument tables up front
+    instruments(song);
+    cache->prefetch(song.frames, 2*song.frame_count);
+    prefetch(song, 0);
+}
 
-    _frames = lookup(info, 0);
-    _insts = lookup(_data, 1);
+// Load the instrument table and the sequences of each instrument, the
+// table is taken to end where the first instrument's data starts
+void NSF::instruments(const Song &song) {
+    uint16_t end = 0xffff;
+    unsigned count = 0;
 
-    _frame   = _frame_count   = info[2];
-    _pattern = _pattern_count = info[3];
-    _tick    = _tick_count    = info[4];
+    while (count < 0x100 && song.insts + 2*count < end) {
+        uint16_t inst = song.lookup(song.insts, count);
+        if (!inst) break;
+
+        if (inst > song.insts && inst < end) {
+            end = inst;
+        }
+
+        count++;
+    }
+
+    song.cache->prefetch(song.insts, 2*count);
+
+    for (unsigned i = 0; i < count; i++) {
+        uint16_t inst = song.lookup(song.insts, i);
+        uint8_t mask = song.read(inst++);
+
+        for (unsigned j = 0; j < NSF_SEQUENCES; j++) {
+            if (mask & (1 << j)) {
+                uint16_t seq = song.lookup(inst, 0);
+                song.cache->prefetch(seq, 4 + song.read(seq));
+                inst += 2;
+            }
+        }
+    }
+}
+
+// Load the patterns of a frame ahead of use
+void NSF::prefetch(const Song &song, unsigned frame) {
+    if (!song.cache) return;
+
+    if (frame >= song.frame_count) {
+        frame = 0;
+    }
+
+    // expansion channels follow the DPCM channel
+    unsigned width = NSF_APU_CHANNELS;
+    if (song.expansion) {
+        width = NSF_SLOT_DPCM+1
+            + ((song.expansion & NSF_EXPANSION_VRC6) ? 3 : 0)
+            + ((song.expansion & NSF_EXPANSION_N163) ? song.voices : 0);
+    }
+
+    uint16_t patterns = song.lookup(song.frames, frame);
+    song.cache->prefetch(patterns, 2*width);
+
+    for (unsigned i = 0; i < width; i++) {
+        if (i != NSF_SLOT_DPCM) {
+            song.cache->prefetch(song.lookup(patterns, i));
+        }
+    }
+}
+
+// Bind channels to the song's frames and attach the
+// expansion chips used by the song, channels the song
+// does not use are disabled
+void NSF::expand(const Song &song) {
+    for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        _channels[i]._slot = i < NSF_APU_CHANNELS ? i : SLOT_NONE;
+        _channels[i]._n163 = false;
+    }
+
+    // expansion frames follow the DPCM channel in chip order
+    unsigned slot = NSF_SLOT_DPCM+1;
+
+#if NSF_VRC6
+    if (song.expansion & NSF_EXPANSION_VRC6) {
+        for (unsigned i = 0; i < 3; i++) {
+            _channels[NSF_APU_CHANNELS + i]._slot = slot + i;
+        }
+    }
+#endif
+
+    if (song.expansion & NSF_EXPANSION_VRC6) {
+        slot += 3;
+    }
+
+#if NSF_N163
+    if (song.expansion & NSF_EXPANSION_N163) {
+        unsigned first = NSF_CHANNELS - N163_VOICES;
+        unsigned voices = song.voices < N163_VOICES ? song.voices : N163_VOICES;
+
+        for (unsigned i = 0; i < voices; i++) {
+            _channels[first + i]._slot = slot + i;
+            _channels[first + i]._n163 = true;
+        }
+    }
+#endif
+
+    for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        if (_channels[i]._slot == SLOT_NONE) {
+            _channels[i].disable();
+        }
+    }
+
+    if (_deferred) {
+        _post |= HANDOFF_EXPAND;
+    } else {
+        chips(song.expansion, song.voices);
+    }
+}
+
+// Attach expansion chips to the APU
+void NSF::chips(uint8_t expansion, uint8_t voices) {
+    _apu.apu.expand(0);
+
+#if NSF_VRC6
+    if (expansion & NSF_EXPANSION_VRC6) {
+        _apu.apu.expand(&_apu.vrc6);
+    }
+#endif
+
+#if NSF_N163
+    if (expansion & NSF_EXPANSION_N163) {
+        _apu.n163.enable(voices);
+        _apu.apu.expand(&_apu.n163);
+    }
+#else
+    (void)expansion;
+    (void)voices;
+#endif
+}
+
+// Set the APU gain, deferred players hand it to the ticker
+void NSF::gain(uint16_t gain) {
+    if (!_deferred) {
+        _apu.apu.gain(gain);
+        return;
+    }
+
+    _post_gain = gain;
+    _post |= HANDOFF_GAIN;
+}
+
+// Switch to a prepared song at the current tick
+void NSF::play(const Song &song) {
+    _song = song;
+    _epoch++;
+
+    _frame = 0;
+    _pattern = _song.pattern_count;
+    _tick = _tick_count = _song.tick_count;
+
+    _loop = false;
+    _halt = false;
+    _loops = 0;
+    _fade = 0;
+    gain(0x100);
 
     // Reset instruments
     for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        if (_channels[i]._enabled) {
+            _channels[i].disable();
+        }
+
         _channels[i].reset();
     }
+
+    expand(_song);
+}
+
+// Step the frame sequencer, the engine ticks at the end of each frame
+void NSF::step() {
+    if (_apu.apu.step()) {
+        tick();
+    }
 }
 
 // Step NSF engine
 void NSF::tick() {
+    if (!_deferred) {
+        advance();
+        return;
+    }
+
+    // apply finished handoffs and post the next tick
+    uint8_t tail = _tail.load(std::memory_order_relaxed);
+
+    while (tail != _head.load(std::memory_order_acquire)) {
+        const Handoff &handoff = _handoffs[tail % NSF_SNAPSHOTS];
+        uint8_t flags = handoff.flags;
+
+        if (flags & HANDOFF_EXPAND) {
+            chips(handoff.expansion, handoff.voices);
+        }
+
+        for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+            _channels[i]._out.apply(handoff.channels[i]);
+        }
+
+        if (flags & HANDOFF_GAIN) {
+            _apu.apu.gain(handoff.gain);
+        }
+
+        if (_log) {
+            _log->tick();
+        }
+
+        tail++;
+        _tail.store(tail, std::memory_order_release);
+
+        if (flags & HANDOFF_STOP) {
+            _running = false;
+            _ticker.detach();
+            return;
+        }
+    }
+
+    _events.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Run the sequencer for one tick
+void NSF::advance() {
     // tick interval
     if (_tick == _tick_count) {
         _tick = 0;
 
         // pattern interval
-        if (_pattern == _pattern_count) {
+        if (_pattern == _song.pattern_count) {
             _pattern = 0;
 
             // frame interval
-            if (_frame == _frame_count) {
+            if (_frame == _song.frame_count) {
                 _frame = 0;
             }
 
             // setup next frame
             for (unsigned i = 0; i < NSF_CHANNELS; i++) {
-                _channels[i].frame(lookup(lookup(_frames, _frame), i));
+                if (_channels[i]._slot == SLOT_NONE) continue;
+
+                _channels[i].frame(lookup(lookup(_song.frames, _frame),
+                        _channels[i]._slot));
             }
 
             _frame++;
+            prefetch(_song, _frame);
         }
 
         _pattern++;
 
         // run commands
         for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+            if (_channels[i]._slot == SLOT_NONE) continue;
             _channels[i].exec();
         }
+
+        // keep a page of each pattern loaded ahead of its commands
+        if (_song.cache) {
+            for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+                if (_channels[i]._slot == SLOT_NONE) continue;
+                _song.cache->prefetch(_channels[i]._cmds, STORAGE_PAGE_SIZE);
+            }
+        }
     }
 
     _tick++;
 
     // update channels
     for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        if (_channels[i]._slot == SLOT_NONE) continue;
         _channels[i].tick();
     }
+
+    // changes made when the song ends belong to this tick
+    end();
+
+    if (_log && !_deferred) {
+        _log->tick();
+    }
+}
+
+// Check for the end of the song before the next tick
+void NSF::end() {
+    if (_halt) {
+        _halt = false;
+        finished();
+        return;
+    }
+
+    if (_fade) {
+        if (--_fade == 0) {
+            finished();
+        } else {
+            gain((_fade << 8) / _fade_count);
+        }
+
+        return;
+    }
+
+    // loops are found when the next tick starts an earlier frame
+    if (_tick == _tick_count && _pattern == _song.pattern_count) {
+        if (_frame == _song.frame_count) {
+            _loop = true;
+        }
+
+        if (_loop) {
+            _loop = false;
+
+            if (_loop_limit && ++_loops >= _loop_limit) {
+                if (_fade_count) {
+                    _fade = _fade_count;
+                } else {
+                    finished();
+                }
+            }
+        }
+    }
+}
+
+// Check if the next tick starts a new frame
+bool NSF::entering() {
+    return _tick == _tick_count && _pattern == _song.pattern_count;
+}
+
+// Hash of the state that decides the output of the next frame, leaving
+// out the command pointers and delays that are reset on frame entry
+// and the waveform phases of the synthesizer
+uint32_t NSF::key() {
+    Digest digest;
+
+    const void *song[] = {_song.data, _song.cache};
+    digest.update((const uint8_t *)song, sizeof song);
+
+    uint8_t sequencer[] = {
+        (uint8_t)(_song.frames), (uint8_t)(_song.frames >> 8),
+        (uint8_t)(_song.insts), (uint8_t)(_song.insts >> 8),
+        _tick_count, _loop, _halt, _loops, _loop_limit,
+        (uint8_t)(_fade), (uint8_t)(_fade >> 8),
+        (uint8_t)(_apu.apu._gain), (uint8_t)(_apu.apu._gain >> 8),
+    };
+    digest.update(sequencer, sizeof sequencer);
+
+    for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        Channel &channel = _channels[i];
+        const uint8_t *start = (const uint8_t *)&channel._slide_target;
+
+        // a held row still reads from the old commands
+        if (channel._hold) {
+            start = (const uint8_t *)&channel._cmds;
+        }
+
+        digest.update(start, (const uint8_t *)&channel._delay - start);
+        digest.update(&channel._cut,
+                (const uint8_t *)&channel._out - &channel._cut);
+
+        apu::Channel::Snapshot synth;
+        _apu.channels[i]->save(synth);
+
+        uint8_t control[] = {
+            (uint8_t)(synth.period), (uint8_t)(synth.period >> 8),
+            (uint8_t)(synth.pitch), (uint8_t)(synth.pitch >> 8),
+            synth.duty, synth.volume, synth.envelope, synth.decay,
+            synth.length, synth.length_load, synth.sweep,
+        };
+        digest.update(control, sizeof control);
+    }
+
+    return digest.value();
+}
+
+// Save/restore the sequencer and synthesizer state
+void NSF::save(Snapshot &snapshot) {
+    snapshot.frame = _frame;
+    snapshot.pattern = _pattern;
+    snapshot.tick = _tick;
+    snapshot.tick_count = _tick_count;
+
+    snapshot.loop = _loop;
+    snapshot.halt = _halt;
+    snapshot.loops = _loops;
+    snapshot.fade = _fade;
+    snapshot.gain = _apu.apu._gain;
+
+    for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        memcpy(snapshot.channels[i], &_channels[i], sizeof(Channel));
+        _apu.channels[i]->save(snapshot.synth[i]);
+    }
+}
+
+void NSF::restore(const Snapshot &snapshot) {
+    _frame = snapshot.frame;
+    _pattern = snapshot.pattern;
+    _tick = snapshot.tick;
+    _tick_count = snapshot.tick_count;
+
+    _loop = snapshot.loop;
+    _halt = snapshot.halt;
+    _loops = snapshot.loops;
+    _fade = snapshot.fade;
+    _apu.apu._gain = snapshot.gain;
+
+    for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        memcpy(&_channels[i], snapshot.channels[i], sizeof(Channel));
+        _apu.channels[i]->restore(snapshot.synth[i]);
+    }
+}
+
+// Defer sequencing out of interrupt context
+void NSF::defer(bool deferred) {
+    // streamed songs must not be read from interrupt context
+    if (!deferred && _song.cache) return;
+
+    _events.store(0);
+    _head.store(0);
+    _tail.store(0);
+    _post = 0;
+
+    for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+        _channels[i]._out.sync();
+        _channels[i]._out.deferred = deferred;
+    }
+
+    _deferred = deferred;
+}
+
+// Run pending sequencer ticks
+unsigned NSF::dispatch() {
+    unsigned count = 0;
+    uint8_t head = _head.load(std::memory_order_relaxed);
+
+    while (_events.load(std::memory_order_relaxed) > 0) {
+        // wait for a free snapshot
+        uint8_t tail = _tail.load(std::memory_order_acquire);
+        if ((uint8_t)(head - tail) >= NSF_SNAPSHOTS) {
+            break;
+        }
+
+        _events.fetch_sub(1, std::memory_order_relaxed);
+
+        // a stopping player only hands off its last changes
+        if (!_stopping.load(std::memory_order_relaxed)) {
+            advance();
+        }
+
+        Handoff &handoff = _handoffs[head % NSF_SNAPSHOTS];
+
+        for (unsigned i = 0; i < NSF_CHANNELS; i++) {
+            handoff.channels[i] = _channels[i]._out.state;
+            _channels[i]._out.state.flags = 0;
+        }
+
+        handoff.gain = _post_gain;
+        handoff.expansion = _song.expansion;
+        handoff.voices = _song.voices;
+        handoff.flags = _post;
+        _post = 0;
+
+        head++;
+        _head.store(head, std::memory_order_release);
+        count++;
+    }
+
+    return count;
+}
+
+// Called when the song ends
+void NSF::finished() {
+    stop();
+}
+
+// End the song after looping a number of times
+void NSF::limit(uint8_t loops, uint16_t fade) {
+    _loop_limit = loops;
+    _fade_count = fade;
+    _loops = 0;
 }
 
 // Starting/stopping the player
 void NSF::start() {
-    _ticker.attach_us(this, &NSF::tick, 1000000/NSF_FREQ);
+    _stopping = false;
+    _running = true;
+
+    // a bus drives the engine from its own timer
+    if (!_apu.apu._bus) {
+        _ticker.attach_us(this, &NSF::step, 1000000/APU_SEQUENCER_FREQ);
+    }
 }
 
 void NSF::stop() {
-    _ticker.detach();
-
     for (unsigned i = 0; i < NSF_CHANNELS; i++) {
         _channels[i].disable();
     }
+
+    // the ticker of a deferred player stops once
+    // the disabled channels are handed to it
+    if (_deferred && _running) {
+        _stopping = true;
+        _post |= HANDOFF_STOP;
+        return;
+    }
+
+    _running = false;
+    _ticker.detach();
+}
+
+// Record channel control calls into a log, 0 stops recording
+void NSF::record(Log *log) {
+    _log = log;
+    _apu.apu.record(log);
+}
+
+// Tap the channel outputs into a scope, 0 removes the tap
+void NSF::scope(Scope *scope) {
+    _apu.apu.scope(scope);
 }
 
 // Get the current 6-bit amplitude of the APU
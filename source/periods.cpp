@@ -0,0 +1,85 @@
+
+// Note Periods
+//
+
+#include "apu/periods.h"
+#include "apu/tables.h"
+
+using namespace apu;
+
+
+// Period of a note on the NES timer, starting at A1, the last
+// entry marks the end of the table
+#define PERIODS 88
+
+struct NotePeriods {
+    static constexpr unsigned short entry(unsigned n) {
+        return n >= PERIODS-1 ? 0
+            : (unsigned short)(APU_FREQ
+                / (2.0 * APU_TUNING * semitones(n)) - 1 + 0.5);
+    }
+};
+
+// Period of a note on a timer stepping through a number of
+// steps per cycle, for the expansion chips
+template <unsigned STEPS>
+struct StepPeriods {
+    static constexpr unsigned short entry(unsigned n) {
+        return n >= PERIODS-1 ? 0
+            : (unsigned short)(8.0*APU_FREQ
+                / (STEPS * APU_TUNING * semitones(n)) - 1 + 0.5);
+    }
+};
+
+// Period lookup tables
+const static unsigned short *PTABLE = Table<NotePeriods, PERIODS>::table;
+const static unsigned short *PULSE_PTABLE =
+        Table<StepPeriods<16>, PERIODS>::table;
+const static unsigned short *SAW_PTABLE =
+        Table<StepPeriods<14>, PERIODS>::table;
+
+// Noise period lookup tables, these are fixed by the hardware
+constexpr static unsigned short NTSC_NTABLE[] = {
+    0xfe4, 0x7f2, 0x3f8, 0x2fa, 0x1fc, 0x17c, 0xfe, 0xca,
+    0xa0,  0x80,  0x60,  0x40,  0x20,  0x10,  0x8,  0x4
+};
+
+constexpr static unsigned short PAL_NTABLE[] = {
+    0xec2, 0x762, 0x3b0, 0x2c4, 0x1d8, 0x162, 0xec, 0xbc,
+    0x94,  0x76,  0x58,  0x3c,  0x1e,  0xe,   0x8,  0x4
+};
+
+// Noise period lookup table
+const static unsigned short *NTABLE =
+        APU_REGION == APU_PAL ? PAL_NTABLE : NTSC_NTABLE;
+
+
+// NES channels
+uint16_t Periods::square(uint8_t note) {
+    return PTABLE[note - 9] << 1;
+}
+
+uint16_t Periods::triangle(uint8_t note) {
+    return PTABLE[note - 9];
+}
+
+uint16_t Periods::noise(uint8_t note) {
+    return NTABLE[note & 0xf];
+}
+
+// Expansion channels
+uint16_t Periods::pulse(uint8_t note) {
+    return PULSE_PTABLE[note - 9];
+}
+
+uint16_t Periods::saw(uint8_t note) {
+    return SAW_PTABLE[note - 9];
+}
+
+uint16_t Periods::wave(uint8_t note, uint8_t size) {
+    if (!size) return 0;
+
+    // cycles per wave sample
+    return ((PULSE_PTABLE[note - 9] + 1) << 4) / size;
+}
+
@@ -0,0 +1,101 @@
+
+// NSF Playlist
+//
+
+#include "apu/playlist.h"
+
+using namespace apu;
+
+
+// Playlist lifetime
+Playlist::Playlist(Entry *entries, unsigned count, PinName pin)
+  : NSF(pin)
+  , _entries(entries)
+  , _count(count)
+  , _current(0)
+  , _next_entry(0)
+  , _ready(false) {
+    // streamed entries are only read from the dispatch thread
+    for (unsigned i = 0; i < _count; i++) {
+        if (!_entries[i].data) {
+            defer();
+            break;
+        }
+    }
+}
+
+// Parse the header of an entry's song
+void Playlist::prepare(Song &song, unsigned entry) {
+    if (_entries[entry].data) {
+        NSF::prepare(song, _entries[entry].data, _entries[entry].song,
+                _entries[entry].expansion, _entries[entry].voices);
+    } else {
+        NSF::prepare(song, _entries[entry].cache, _entries[entry].song,
+                _entries[entry].expansion, _entries[entry].voices);
+    }
+}
+
+// Loads an entry in the playlist
+void Playlist::select(unsigned entry) {
+    if (entry >= _count) return;
+
+    if (!_entries[entry].data) {
+        _entries[entry].cache->flush();
+    }
+
+    Song song;
+    prepare(song, entry);
+    play(song);
+    limit(_entries[entry].loops, _entries[entry].fade);
+
+    _current.store(entry, std::memory_order_release);
+    _ready.store(false, std::memory_order_release);
+}
+
+// Prepares the next song
+void Playlist::preload() {
+    preload(false);
+}
+
+void Playlist::preload(bool streamed) {
+    if (_ready.load(std::memory_order_acquire)) return;
+
+    unsigned entry = (_current.load(std::memory_order_acquire) + 1) % _count;
+    if (!_entries[entry].data && !streamed) return;
+
+    prepare(_next, entry);
+    _next_entry = entry;
+    _ready.store(true, std::memory_order_release);
+}
+
+// Run pending sequencer ticks and preload the next song
+// from the same thread that reads streamed songs
+unsigned Playlist::dispatch() {
+    unsigned count = NSF::dispatch();
+    preload(true);
+    return count;
+}
+
+// Switch to the next song when the current one ends
+void Playlist::finished() {
+    unsigned entry = (_current.load(std::memory_order_relaxed) + 1) % _count;
+
+    // the preloaded song may be for an entry that was since replaced
+    Song song;
+    if (_ready.load(std::memory_order_acquire) && _next_entry == entry) {
+        song = _next;
+    } else {
+        prepare(song, entry);
+    }
+
+    _current.store(entry, std::memory_order_release);
+    _ready.store(false, std::memory_order_release);
+
+    play(song);
+    limit(_entries[entry].loops, _entries[entry].fade);
+}
+
+// Get the entry currently playing
+unsigned Playlist::current() {
+    return _current.load(std::memory_order_acquire);
+}
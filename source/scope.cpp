@@ -0,0 +1,77 @@
+
+// Oscilloscope Tap
+//
+
+#include "apu/scope.h"
+#include "apu/apu.h"
+
+using namespace apu;
+
+
+// Scope lifetime
+Scope::Scope(uint8_t decimate)
+  : _head(0)
+  , _decimate(decimate ? decimate : 1)
+  , _count(0) {
+    for (unsigned i = 0; i < SCOPE_SIZE; i++) {
+        for (unsigned j = 0; j < SCOPE_CHANNELS+1; j++) {
+            _samples[i][j] = 0;
+        }
+    }
+}
+
+
+// Record a sample, called by the renderer
+void Scope::write(APU *apu, uint8_t mix) {
+    if (++_count < _decimate) return;
+    _count = 0;
+
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    uint8_t *sample = _samples[head % SCOPE_SIZE];
+
+    for (unsigned i = 0; i < SCOPE_CHANNELS; i++) {
+        Channel *channel = apu->find(i);
+        sample[i] = channel ? channel->output() : 0;
+    }
+
+    sample[SCOPE_MIX] = mix;
+    _head.store(head + 1, std::memory_order_release);
+}
+
+// Copy the latest samples of a channel oldest first
+unsigned Scope::read(unsigned channel, uint8_t *buffer, unsigned count) {
+    if (channel > SCOPE_MIX) return 0;
+
+    // The slot after the head may be mid-write, so one
+    // less than the size of the ring can be read
+    uint32_t head = _head.load(std::memory_order_acquire);
+
+    if (count > SCOPE_SIZE-1) count = SCOPE_SIZE-1;
+    if (count > head) count = head;
+
+    uint32_t start = head - count;
+
+    for (unsigned i = 0; i < count; i++) {
+        buffer[i] = _samples[(start + i) % SCOPE_SIZE][channel];
+    }
+
+    // Drop the oldest samples if the renderer wrapped
+    // around onto them while they were being copied
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint32_t end = _head.load(std::memory_order_relaxed);
+    uint32_t lost = end - start + 1 > SCOPE_SIZE
+            ? end - start + 1 - SCOPE_SIZE : 0;
+
+    if (lost >= count) return 0;
+
+    for (unsigned i = lost; i < count; i++) {
+        buffer[i - lost] = buffer[i];
+    }
+
+    return count - lost;
+}
+
+// Number of samples written so far, wraps around
+uint32_t Scope::position() {
+    return _head.load(std::memory_order_acquire);
+}
@@ -0,0 +1,113 @@
+
+// Song Storage
+//
+
+#include "apu/storage.h"
+
+using namespace apu;
+
+
+// Tag for pages that hold no data
+#define INVALID 0xffff
+
+
+// FileStorage lifetime
+FileStorage::FileStorage(FILE *file, uint32_t offset)
+  : _file(file)
+  , _offset(offset) {
+}
+
+// Reads data at an offset, returns the number of bytes read
+unsigned FileStorage::read(uint32_t off, uint8_t *buffer, unsigned size) {
+    if (fseek(_file, _offset + off, SEEK_SET)) {
+        return 0;
+    }
+
+    return fread(buffer, 1, size, _file);
+}
+
+
+// Cache lifetime
+Cache::Cache(Storage *storage)
+  : _storage(storage) {
+    flush();
+}
+
+// Drop all cached pages
+void Cache::flush() {
+    for (unsigned i = 0; i < STORAGE_PAGES; i++) {
+        _tags[i] = INVALID;
+        _ages[i] = 0;
+    }
+
+    _clock = 0;
+    _last = 0;
+}
+
+// Find or load a page, returns the slot holding it
+unsigned Cache::fetch(uint16_t page) {
+    if (_tags[_last] == page) {
+        return _last;
+    }
+
+    // Search for the page, tracking the least recently used slot
+    unsigned slot;
+    unsigned lru = 0;
+
+    for (slot = 0; slot < STORAGE_PAGES; slot++) {
+        if (_tags[slot] == page) {
+            break;
+        }
+
+        if (_ages[slot] < _ages[lru]) {
+            lru = slot;
+        }
+    }
+
+    if (slot == STORAGE_PAGES) {
+        slot = lru;
+
+        unsigned size = _storage->read(
+                page*STORAGE_PAGE_SIZE, _pages[slot], STORAGE_PAGE_SIZE);
+
+        for (unsigned i = size; i < STORAGE_PAGE_SIZE; i++) {
+            _pages[slot][i] = 0;
+        }
+
+        _tags[slot] = page;
+    }
+
+    // Restart the ages if the clock wraps
+    if (++_clock == 0) {
+        for (unsigned i = 0; i < STORAGE_PAGES; i++) {
+            _ages[i] = 0;
+        }
+
+        _clock = 1;
+    }
+
+    _ages[slot] = _clock;
+    _last = slot;
+    return slot;
+}
+
+// Read a byte of song data
+uint8_t Cache::read(uint16_t addr) {
+    unsigned slot = fetch(addr / STORAGE_PAGE_SIZE);
+    return _pages[slot][addr % STORAGE_PAGE_SIZE];
+}
+
+// Load the pages covering a range of song data ahead of use
+void Cache::prefetch(uint16_t addr, unsigned size) {
+    unsigned first = addr / STORAGE_PAGE_SIZE;
+    unsigned last = (addr + (size ? size : 1) - 1) / STORAGE_PAGE_SIZE;
+
+    // Never prefetch more than half the cache
+    if (last - first >= STORAGE_PAGES/2) {
+        last = first + STORAGE_PAGES/2 - 1;
+    }
+
+    for (unsigned page = first; page <= last; page++) {
+        fetch(page);
+    }
+}
@@ -0,0 +1,32 @@
+
+// Render Test Goldens
+//
+// Digests of each track rendered by a known good build, regenerate
+// by building the test with RENDER_UPDATE after an intended change
+//
+
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <stdint.h>
+#include "songs.h"
+
+
+// Digests of the samples and the channel control log
+struct Golden {
+    uint32_t pcm;
+    uint32_t log;
+};
+
+const Golden GOLDENS[] = {
+    {0x08a04f7e, 0x46e3453e}, // apu 0
+    {0x829fa6ef, 0x1d8903ef}, // apu 1
+    {0x244cbf52, 0x3e57ed6e}, // effects 0
+    {0x2aae812e, 0x3f7b8b1e}, // effects 1
+#if NSF_VRC6 && NSF_N163
+    {0x2aeb9725, 0x1ce7947c}, // expansion 0
+#endif
+};
+
+
+#endif
@@ -0,0 +1,209 @@
+
+// Render Test
+//
+// Renders each track through a bus for a fixed duration, compares the
+// digests of the samples and the channel control log against goldens
+// from a known good build, and reports the render time of each track,
+// the log of each track is then replayed and checked against the render,
+// with N163 the render time is also checked to be flat in the number of
+// voices
+//
+
+#include "apu/bus.h"
+#include "apu/digest.h"
+#include "apu/expansion.h"
+#include "songs.h"
+#include "golden.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace apu;
+
+
+// Render settings
+#define RENDER_SECONDS 10
+#define RENDER_LOG_SIZE (32*1024)
+
+// Slowdown allowed rendering all N163 voices over a single voice,
+// in percent
+#define RENDER_N163_SLOWDOWN 200
+
+
+static uint8_t log_data[RENDER_LOG_SIZE];
+
+// Render a track, returns false if the log ran out of space
+static bool render(const Track &track, Golden &digests, unsigned &us) {
+    NSF *nsf = new NSF;
+    Bus bus;
+    Log log(log_data, sizeof log_data);
+
+    bus.attach(nsf);
+    nsf->record(&log);
+    nsf->load(track.data, track.song, track.expansion, track.voices);
+    nsf->start();
+
+    Digest pcm;
+    uint8_t block[BUS_BLOCK];
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned n = 0; n < RENDER_SECONDS*BUS_FREQ; n += BUS_BLOCK) {
+        bus.render(block, BUS_BLOCK);
+        pcm.update(block, BUS_BLOCK);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    us = std::chrono::duration_cast<std::chrono::microseconds>(
+            end - start).count();
+
+    Digest calls;
+    calls.update(log_data, log.end());
+
+    digests.pcm = pcm.value();
+    digests.log = calls.value();
+
+    bool overflow = log.overflow();
+    delete nsf;
+    return !overflow;
+}
+
+// Replay the log of the last render through a bus on the same
+// chips, returns the digest of the samples, which should match
+// the render
+static uint32_t replay(const Track &track) {
+    Square square1, square2;
+    Triangle triangle;
+    Noise noise;
+    Channel *channels[] = {&square1, &square2, &triangle, &noise};
+
+    APU apu(channels, NSF_APU_CHANNELS);
+    Replay replay(&apu);
+
+#if NSF_VRC6
+    VRC6 vrc6;
+    if (track.expansion & NSF_EXPANSION_VRC6) {
+        apu.expand(&vrc6);
+    }
+#endif
+#if NSF_N163
+    N163 n163;
+    if (track.expansion & NSF_EXPANSION_N163) {
+        n163.enable(track.voices);
+        apu.expand(&n163);
+    }
+#endif
+    (void)track;
+
+    Bus bus;
+
+    bus.attach(&replay);
+    replay.load(log_data);
+    replay.start();
+
+    Digest pcm;
+    uint8_t block[BUS_BLOCK];
+
+    for (unsigned n = 0; n < RENDER_SECONDS*BUS_FREQ; n += BUS_BLOCK) {
+        bus.render(block, BUS_BLOCK);
+        pcm.update(block, BUS_BLOCK);
+    }
+
+    return pcm.value();
+}
+
+#if NSF_N163
+// Render N163 voices directly playing a high note, returns the
+// render time in microseconds
+static unsigned voices(unsigned count) {
+    N163 n163;
+    n163.enable(count);
+
+    uint8_t wave[N163_WAVE_SIZE/2];
+    for (unsigned i = 0; i < sizeof wave; i++) {
+        wave[i] = ((2*i) & 0xf) | ((2*i+1) & 0xf) << 4;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        n163.voices[i].wave(wave, N163_WAVE_SIZE);
+        n163.voices[i].enable();
+        n163.voices[i].note(84);
+    }
+
+    uint8_t cycles[BUS_BLOCK];
+    for (unsigned n = 0; n < BUS_BLOCK; n++) {
+        cycles[n] = APU_FREQ / BUS_FREQ;
+    }
+
+    Digest pcm;
+    uint16_t mix[BUS_BLOCK];
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned n = 0; n < RENDER_SECONDS*BUS_FREQ; n += BUS_BLOCK) {
+        memset(mix, 0, sizeof mix);
+        n163.render(mix, cycles, BUS_BLOCK);
+        pcm.update((const uint8_t*)mix, sizeof mix);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            end - start).count();
+}
+#endif
+
+int main() {
+    unsigned failures = 0;
+
+    for (unsigned i = 0; i < TRACK_COUNT; i++) {
+        Golden digests;
+        unsigned us;
+
+        if (!render(TRACKS[i], digests, us)) {
+            printf("%-12s log overflow\n", TRACKS[i].name);
+            failures++;
+            continue;
+        }
+
+#ifdef RENDER_UPDATE
+        printf("    {0x%08x, 0x%08x}, // %s\n",
+                digests.pcm, digests.log, TRACKS[i].name);
+#else
+        bool pass = digests.pcm == GOLDENS[i].pcm
+                 && digests.log == GOLDENS[i].log;
+
+        printf("%-12s %s pcm %08x log %08x %6u us\n", TRACKS[i].name,
+                pass ? "pass" : "FAIL", digests.pcm, digests.log, us);
+
+        if (!pass) {
+            failures++;
+        }
+#endif
+
+        // songs replay bit-exact from their log
+        if (replay(TRACKS[i]) != digests.pcm) {
+            printf("%-12s replay FAIL\n", TRACKS[i].name);
+            failures++;
+        }
+    }
+
+#if NSF_N163
+    // the best of a few runs keeps out noise from the host
+    unsigned one = -1, all = -1;
+    for (unsigned i = 0; i < 3; i++) {
+        one = std::min(one, voices(1));
+        all = std::min(all, voices(N163_VOICES));
+    }
+
+    bool flat = all*100 <= one*RENDER_N163_SLOWDOWN;
+    printf("%-12s %s 1 voice %u us %u voices %u us\n", "n163 voices",
+            flat ? "pass" : "FAIL", one, N163_VOICES, all);
+
+    if (!flat) {
+        failures++;
+    }
+#endif
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+
+// AnalogOut Stub
+//
+// Host stand-in for the mbed DAC, writes are dropped
+//
+
+#ifndef MBED_ANALOGOUT_H
+#define MBED_ANALOGOUT_H
+
+#include <stdint.h>
+
+enum PinName {
+    DAC0_OUT,
+};
+
+namespace mbed {
+
+
+class AnalogOut {
+public:
+    AnalogOut(PinName) {}
+    void write_u16(uint16_t) {}
+};
+
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+
+// Ticker Stub
+//
+// Host stand-in for the mbed ticker, nothing is ever called back,
+// so sources have to be driven by rendering through a bus
+//
+
+#ifndef MBED_TICKER_H
+#define MBED_TICKER_H
+
+#include <stdint.h>
+
+typedef uint32_t timestamp_t;
+
+namespace mbed {
+
+
+class Ticker {
+public:
+    template <typename T, typename M>
+    void attach_us(T *, M, timestamp_t) {}
+    void attach_us(void (*)(), timestamp_t) {}
+    void detach() {}
+};
+
+
+}
+
+#endif